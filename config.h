@@ -19,7 +19,8 @@
 #define COUNT_MOD Mod1Mask
 /** The modifier key that is used for motions and operators. */
 #define OTHER_MOD Mod1Mask
-/** Number of workspaces. */
+/** Number of workspaces that howm starts with. Pagers can change this whilst
+ * howm is running, using _NET_NUMBER_OF_DESKTOPS. */
 #define WORKSPACES 5
 /** When moving the mouse over a window, focus on the window? */
 #define FOCUS_MOUSE false
@@ -30,6 +31,10 @@
 #define FOLLOW_MOVE true
 /** The size (in pixels) of the useless gaps. */
 #define GAP 2
+/** Keep the clients of hidden workspaces mapped and move them off-screen,
+ * rather than unmapping them. This makes changing workspace cheaper, as
+ * clients don't need to repaint themselves. */
+#define PARK_WORKSPACES false
 /** Enable debugging output */
 #define DEBUG_ENABLE false
 /** The size (in pixels) of the border. */
@@ -46,6 +51,9 @@
 #define BAR_HEIGHT 20
 /** Whether the status bar is at the top or bottom of the screen. */
 #define BAR_BOTTOM true
+/** Whether space for a bar is reserved on every output, rather than only
+ * on the primary output. */
+#define BAR_ON_ALL_OUTPUTS false
 /** The amount of pixels that the op_shrink_gap and op_grow_gap change the gap
  * size by. */
 #define OP_GAP_SIZE 4
@@ -75,9 +83,13 @@
 /** The path at which the howm binary (or script that started howm) is stored
  * at. This is used for restarts. */
 #define HOWM_PATH "/usr/bin/howm"
-/** The amount of client lists that can be stored in the register before
- * needing to be pasted back. */
+/** The amount of client lists that can be stored in the register. When it is
+ * full, cutting again closes the windows of the oldest list. */
 #define DELETE_REGISTER_SIZE 5
+/** The amount of clients that each workspace's focus history remembers. */
+#define MRU_HISTORY 8
+/** The amount of registers that macros can be recorded into. */
+#define MACRO_REGISTERS 4
 /** The height of the floating scratchpad window. */
 #define SCRATCHPAD_HEIGHT 500
 /** The width of the floating scratchpad window. */
@@ -88,11 +100,25 @@ static const char * const dmenu_cmd[] = {"dmenu_run", "-i", "-b",
 		    "-nb", "#70898f", "-nf", "black",
 		    "-sf", "#74718e", NULL};
 
+static const char * const scratch_term_cmd[] = {"urxvt", "-name", "scratchterm",
+		    NULL};
+
+/**
+ * @brief Named scratchpads, which are shown and hidden with toggle_scratchpad.
+ *
+ * In the form:
+ *
+ * {Name, Command, Width, Height}
+ */
+static const Scratchpad scratchpads[] = {
+	{"scratchterm", scratch_term_cmd, SCRATCHPAD_WIDTH, SCRATCHPAD_HEIGHT}
+};
+
 /* Rules that are applied to clients as they are spawned. */
 static const Rule rules[] = {
-	/* Class, WS, follow, float, fullscreen */
-	{"dwb", 3, false, false, false},
-	{"mpv", 5, false, false, false}
+	/* String, WS, follow, float, fullscreen, key */
+	{"dwb", 3, false, false, false, MATCH_NAME},
+	{"mpv", 5, false, false, false, MATCH_NAME}
 };
 
 /** @brief The standard key map, feel free to change them.
@@ -122,9 +148,12 @@ static const Key keys[] = {
 	{ MODKEY | ShiftMask, NORMAL, XK_m, resize_master, {.i = -5} },
 	{ MODKEY, NORMAL, XK_b, toggle_bar, {NULL} },
 	{ MODKEY, NORMAL, XK_period, replay, {NULL} },
+	{ MODKEY, NORMAL, XK_r, toggle_recording, {.i = 0} },
+	{ MODKEY | ShiftMask, NORMAL, XK_r, play_macro, {.i = 0} },
 	{ MODKEY, NORMAL, XK_p, paste, {NULL} },
 	{ MODKEY, NORMAL, XK_q, send_to_scratchpad, {NULL} },
 	{ MODKEY | ShiftMask, NORMAL, XK_q, get_from_scratchpad, {NULL} },
+	{ MODKEY, NORMAL, XK_grave, toggle_scratchpad, {.i = 0} },
 
 	{ MODKEY | ShiftMask, FLOATING, XK_k, resize_float_height, {.i = -10} },
 	{ MODKEY | ShiftMask, FLOATING, XK_j, resize_float_height, {.i = 10} },
@@ -147,6 +176,7 @@ static const Key keys[] = {
 	{ MODKEY, FOCUS, XK_space, toggle_fullscreen, {NULL} },
 	{ MODKEY, FOCUS, XK_Tab, focus_urgent, {NULL} },
 	{ MODKEY, FOCUS, XK_k, focus_prev_client, {NULL} },
+	{ MODKEY, FOCUS, XK_o, focus_mru, {NULL} },
 	{ MODKEY, FOCUS, XK_j, focus_next_client, {NULL} },
 	{ MODKEY | ShiftMask, FOCUS, XK_k, move_current_up, {NULL} },
 	{ MODKEY | ShiftMask, FOCUS, XK_j, move_current_down, {NULL} },
@@ -168,6 +198,18 @@ static const Key keys[] = {
 	{ MODKEY | ShiftMask, FOCUS, XK_f, change_mode, {.i = FLOATING} }
 };
 
+/**
+ * @brief Mouse bindings, used when a button is pressed over a client.
+ *
+ * In the form:
+ *
+ * {Modifier, Button, Command, Args}
+ */
+static const Button buttons[] = {
+	{ MODKEY, XCB_BUTTON_INDEX_1, mouse_move, {NULL} },
+	{ MODKEY, XCB_BUTTON_INDEX_3, mouse_resize, {NULL} }
+};
+
 /**
  * @brief The operations to be performed on a target. All functions that are
  * operators begin with op_*.
@@ -205,12 +247,15 @@ static const Motion motions[] = {
 };
 
 /**
- * @brief Workspaces and their default layout.
+ * @brief The default layout of each workspace.
+ *
+ * Workspaces past the end of this list, such as those added whilst howm is
+ * running, use the settings of the last item.
  *
- * Note: The first item is NULL as workspaces are indexed from 1.
+ * Note: The first item is empty as workspaces are indexed from 1.
  */
-static Workspace wss[] = {
-	{0, 0, 0, 0, 0, NULL, NULL, NULL},
+static const Workspace ws_defaults[] = {
+	{0},
 	{.layout = HSTACK, .gap = GAP, .master_ratio = 0.6, .bar_height = BAR_HEIGHT},
 	{.layout = HSTACK, .gap = GAP, .master_ratio = 0.6, .bar_height = BAR_HEIGHT},
 	{.layout = HSTACK, .gap = GAP, .master_ratio = 0.6, .bar_height = BAR_HEIGHT},
@@ -224,10 +269,12 @@ _Static_assert(DEFAULT_WORKSPACE > 0 && DEFAULT_WORKSPACE <= WORKSPACES, "DEFAUL
 _Static_assert(GAP >= 0, "GAP can't be negative.");
 _Static_assert(BORDER_PX >= 0, "BORDER_PX can't be negative.");
 _Static_assert(OP_GAP_SIZE >= 0, "OP_GAP_SIZE can't be negative.");
+_Static_assert(MRU_HISTORY >= 1, "MRU_HISTORY must be at least 1.");
 _Static_assert(BAR_HEIGHT >= 0, "BAR_HEIGHT can't be negative.");
 _Static_assert(FLOAT_SPAWN_HEIGHT >= 0, "FLOAT_SPAWN_HEIGHT can't be negative.");
 _Static_assert(FLOAT_SPAWN_WIDTH >= 0, "FLOAT_SPAWN_WIDTH can't be negative.");
-_Static_assert(LENGTH(wss) == WORKSPACES + 1, "wss must contain one more workspace than WORKSPACES.");
+_Static_assert(LENGTH(ws_defaults) >= 2, "ws_defaults must contain at least one workspace after the empty first item.");
+_Static_assert(MACRO_REGISTERS >= 1, "MACRO_REGISTERS must be at least 1.");
 _Static_assert(SCRATCHPAD_WIDTH >= 0, "SCRATCHPAD_WIDTH can't be negative.");
 _Static_assert(SCRATCHPAD_HEIGHT >= 0, "SCRATCHPAD_HEIGHT can't be negative.");
 #endif
@@ -11,6 +11,7 @@
 #include <xcb/xcb_icccm.h>
 #include <xcb/xcb_keysyms.h>
 #include <xcb/xcb_ewmh.h>
+#include <xcb/randr.h>
 
 /**
  * @file howm.c
@@ -44,6 +45,19 @@
 /** Supresses the unused variable compiler warnings. */
 #define UNUSED(x) (void)(x)
 
+/** How many batches of layout requests are remembered when deciding whether
+ * an EnterNotify was caused by howm. */
+#define LAYOUT_SEQ_RANGES 4
+
+/** The number of slots that the window index starts with. Must be a power of
+ * two. */
+#define WIN_INDEX_MIN 64
+
+/** How many clients are allocated together in one slab of the client pool. */
+#define CLIENT_SLAB_SIZE 64
+/** The most workspaces that can be asked for at runtime. */
+#define WORKSPACES_MAX 1024
+
 #define _NET_WM_STATE_REMOVE 0
 #define _NET_WM_STATE_ADD 1
 #define _NET_WM_STATE_TOGGLE 2
@@ -77,14 +91,29 @@ typedef struct {
  * @brief Represents a rule that is applied to a client upon it starting.
  */
 typedef struct {
-	const char *class; /**<	The class or name of the client. */
+	const char *class; /**<	The string to look for in the property that
+			     key selects. */
 	int ws; /**<  The workspace that the client should be spawned
 				on (0 means current workspace). */
 	bool follow; /**< If the client is spawned on another ws, shall we follow? */
 	bool is_floating; /**< Spawn the client in a floating state? */
 	bool is_fullscreen; /**< Spawn the client in a fullscreen state? */
+	int key; /**< The property that is searched (MATCH_NAME, the default,
+		   searches both the instance and the class). */
 } Rule;
 
+/**
+ * @brief Represents a named scratchpad, which is started on first use and
+ * then kept running out of view.
+ */
+typedef struct {
+	const char *name; /**< Matched against the class or name of a newly
+			    mapped window, in the same way as rules. */
+	const char * const *cmd; /**< The command that starts the scratchpad. */
+	uint16_t w; /**< The width of the scratchpad when it is shown. */
+	uint16_t h; /**< The height of the scratchpad when it is shown. */
+} Scratchpad;
+
 /**
  * @brief Represents an operator.
  *
@@ -129,28 +158,79 @@ typedef struct {
 	const Arg arg; /**< The argument passed to the above function. */
 } Button;
 
+/** The properties of a client that rules can match against. */
+enum client_props { PROP_INSTANCE, PROP_CLASS, PROP_TITLE, PROP_ROLE, END_PROP };
+
 /**
  * @brief Represents a client that is being handled by howm.
  *
  * All the attributes that are needed by howm for a client are stored here.
  */
 typedef struct Client {
-	struct Client *next; /**< Clients are stored in a linked list-
+	struct Client *next; /**< Clients are stored in a doubly linked list-
 					* this represents the client after this one. */
+	struct Client *prev; /**< The client before this one. */
+	struct Client *mru_next; /**< The client on the same workspace that was
+				   focused less recently than this one, or
+				   NULL if this client has fallen out of
+				   the focus history. */
+	struct Client *mru_prev; /**< The client on the same workspace that was
+				   focused more recently than this one. */
 	bool is_fullscreen; /**< Is the client fullscreen? */
 	bool is_floating; /**< Is the client floating? */
 	bool is_transient; /**< Is the client transient?
 					* Defined at: http://standards.freedesktop.org/wm-spec/wm-spec-latest.html*/
 	bool is_urgent; /** This is set by a client that wants focus for some reason. */
+	struct Client *urg_next; /**< The client that became urgent after this
+				   one. */
+	struct Client *urg_prev; /**< The client that became urgent before this
+				   one. */
+	bool is_parked; /**< Is the client's window mapped but moved off-screen?
+			  Whilst it is, x and y still hold where the window
+			  goes when it is shown, and the window is really at
+			  park_x. */
+	int16_t park_x; /**< The x coordinate that the window was parked at. */
+	bool is_mapped; /**< Has howm mapped the client's window? */
+	unsigned int scratch_id; /**< The index of the named scratchpad that
+				   this client is, plus one. Zero if it isn't
+				   one. */
+	unsigned int unmaps_expected; /**< How many UnmapNotify events are still
+					to come from windows that howm unmapped. */
 	xcb_window_t win; /**< The window that this client represents. */
-	uint16_t x; /**< The x coordinate of the client. */
-	uint16_t y; /**< The y coordinate of the client. */
+	uint32_t id; /**< The client's index in the client pool, which never
+		       changes. */
+	int ws; /**< The workspace that the client is on. 0 when it isn't on a
+		  workspace, such as when it is on the scratchpad. */
+	int16_t x; /**< The x coordinate of the client on screen. Signed, as
+		     outputs can have negative RandR offsets. */
+	int16_t y; /**< The y coordinate of the client. */
 	uint16_t w; /**< The width of the client.*/
 	uint16_t h; /**< The height of the client.*/
 	uint16_t gap; /** The size of the useless gap between this client and
 			the others. */
+	char *props[END_PROP]; /**< The client's instance, class, title and
+				 role, fetched when it was mapped and kept up to
+				 date by PropertyNotify. NULL if a property
+				 isn't set. */
 } Client;
 
+/**
+ * @brief The tile geometry that a layout handler last computed for a
+ * workspace, along with everything that it was computed from.
+ *
+ * The geometry is from before the gaps and borders are applied, as those are
+ * cheap and differ per client.
+ */
+struct layout_memo {
+	int layout; /**< The layout that computed the geometry. */
+	unsigned int n; /**< The amount of tiles. */
+	float master_ratio; /**< The workspace's master_ratio at the time. */
+	xcb_rectangle_t area; /**< The area that the tiles were fitted into. */
+	uint16_t *geom; /**< The x, y, w and h arrays, each cap long, one after
+			  the other. x and y are stored bit for bit. */
+	unsigned int cap; /**< How many tiles geom has space for. */
+};
+
 /**
  * @brief Represents a workspace, which stores clients.
  *
@@ -164,14 +244,52 @@ typedef struct {
 	uint16_t gap; /**< The size of the useless gap between windows for this workspace. */
 	float master_ratio; /** The ratio of the size of the master window
 				 compared to the screen's size. */
-	uint16_t bar_height; /** The height of the space left for a bar. Stored
-			      here so it can be toggled per ws. */
+	uint16_t bar_height; /** Whether space is left for a bar (non-zero) or
+			      not (zero). Stored here so it can be toggled per
+			      ws, the size of the space is set per output. */
 	Client *head; /**< The start of the linked list. */
-	Client *prev_foc; /**< The last focused client. This is seperate to
-				* the linked list structure. */
+	Client *tail; /**< The end of the linked list. */
+	Client *mru; /**< The most recently focused client. Up to
+		       MRU_HISTORY clients are kept in a ring, ordered by when
+		       they were last focused, through their mru_next and
+		       mru_prev pointers. */
+	unsigned int mru_cnt; /**< How many clients are in the ring. */
 	Client *current; /**< The client that is currently in focus. */
+	bool dirty; /**< Geometry changes were made whilst this workspace was
+		      hidden and need to be sent when it is next shown. */
+	unsigned int group_cnt[3]; /**< How many clients are in each stacking
+				     group (tiled, floating and fullscreen). */
+	Client **part; /**< The clients partitioned by stacking group, keeping
+			 the order of the client list within each group. */
+	unsigned int part_cap; /**< How many clients part has space for. */
+	bool part_dirty; /**< The client list has changed since part was last
+			   built. */
+	unsigned int busy_slot; /**< The position of this workspace in busy_ws,
+				  plus one. Zero if it has no clients. */
+	unsigned int urgent_cnt; /**< How many of the clients are urgent. */
+	struct layout_memo memo; /**< The last tile geometry computed for this
+				   workspace. */
+	bool arrange_pending; /**< The workspace was arranged during a
+				transaction and needs to be arranged for real
+				when it is committed. */
 } Workspace;
 
+/**
+ * @brief Represents an output (such as a monitor) that is discovered using
+ * RandR.
+ *
+ * Each output shows one workspace at a time.
+ */
+typedef struct {
+	int16_t x; /**< The x coordinate of the output's top left corner. */
+	int16_t y; /**< The y coordinate of the output's top left corner. */
+	uint16_t w; /**< The width of the output. */
+	uint16_t h; /**< The height of the output. */
+	uint16_t bar_height; /**< The height of the space reserved for a bar on
+			       this output. */
+	int ws; /**< The workspace that is shown on this output. */
+} Monitor;
+
 /**
  * @brief Represents the last command (and its arguments) or the last
  * combination of operator, count and motion (ocm).
@@ -186,26 +304,198 @@ struct replay_state {
 };
 
 /**
- * @brief Represents a stack. This stack is going to hold linked lists of
- * clients. An example of the stack is below:
+ * @brief One step of a macro: either a command and its argument, or an
+ * operator with the type and count that its motion gave it.
+ */
+struct macro_step {
+	void (*cmd)(const Arg *arg); /**< The command, or NULL for an operator. */
+	const Arg *arg; /**< The argument passed to the command. */
+	void (*op)(const unsigned int type, int cnt); /**< The operator. */
+	unsigned int type; /**< The type given by the operator's motion. */
+	int cnt; /**< The count given to the operator. */
+};
+
+/**
+ * @brief A macro register, holding the steps that were recorded into it.
+ */
+struct macro {
+	struct macro_step *steps; /**< The recorded steps, in order. */
+	unsigned int len; /**< How many steps have been recorded. */
+	unsigned int cap; /**< How many steps there is space for. */
+};
+
+/**
+ * @brief The work that has been put off until the end of a transaction.
+ *
+ * Whilst a transaction is open, arranging a workspace only marks it, and
+ * restacking, focusing and printing the status are only noted. They are all
+ * done once, when the transaction is committed.
+ */
+struct transaction {
+	unsigned int depth; /**< How many transactions are open. */
+	bool restack; /**< The current workspace needs restacking. */
+	bool focus; /**< The current client needs to be given focus. */
+	bool info; /**< The status needs to be printed. */
+	bool show; /**< Clients needed to be shown or hidden. */
+	int ws; /**< The current workspace when the transaction was opened. */
+};
+
+/**
+ * @brief A run of clients that was cut out of a client list, linked together
+ * through their next and prev pointers.
+ */
+struct segment {
+	Client *head; /**< The first client of the run. */
+	Client *tail; /**< The last client of the run. */
+	unsigned int cnt; /**< How many clients are in the run. */
+};
+
+/**
+ * @brief The state of a named scratchpad.
+ */
+struct scratch_slot {
+	Client *c; /**< The scratchpad's client, once its window has mapped. */
+	bool spawning; /**< The command has been run and the window is awaited. */
+};
+
+/**
+ * @brief The urgent clients that are on a workspace, oldest first.
+ *
+ * Clients are linked through their urg_next and urg_prev pointers.
+ */
+struct urgent_queue {
+	Client *head; /**< The client that has been urgent for longest. */
+	Client *tail; /**< The client that became urgent most recently. */
+};
+
+/**
+ * @brief The delete register: a ring buffer of the segments that have been
+ * cut, the newest of which is pasted first.
+ *
+ * Once the register is full the oldest segment is pushed out of it to make
+ * room. Its clients are put back on the current workspace and asked to close,
+ * so that a window that refuses (to ask whether to save, say) can still be
+ * reached.
+ */
+struct cut_register {
+	struct segment *segs; /**< Room for DELETE_REGISTER_SIZE segments. Storage
+			is malloced later as we don't know the size yet. */
+	unsigned int first; /**< The index of the oldest segment. */
+	unsigned int size; /**< The amount of segments in the register. */
+	struct segment evicted; /**< The segments pushed out during the current
+				  cut, joined into one run. They are closed by
+				  reg_close_evicted() once the cut is done. */
+};
+
+/**
+ * @brief The geometry of the tiled clients of the workspace that is being
+ * arranged, packed into separate arrays.
+ *
+ * The layouts fill these arrays in, rather than writing to each client, so
+ * that the gaps and borders can be applied to every tiled client in tight
+ * loops that the compiler can vectorise. Only one workspace is arranged at a
+ * time, so the arrays are shared by all of them.
+ */
+struct tiles {
+	Client **c; /**< The tiled clients, in the order of the client list.
+		      This points into the workspace's partitions. */
+	int16_t *x; /**< The x coordinate of each tile. */
+	int16_t *y; /**< The y coordinate of each tile. */
+	uint16_t *w; /**< The width of each tile. */
+	uint16_t *h; /**< The height of each tile. */
+	uint16_t *g; /**< The gap of each tiled client. */
+	unsigned int cap; /**< How many tiles the arrays have space for. */
+	unsigned int len; /**< How many clients c holds, tiled or not. */
+};
+
+/**
+ * @brief A pool of clients, which are allocated in slabs.
+ *
+ * Clients are handed out from contiguous slabs rather than being scattered
+ * across the heap, and are recycled through a free list. A slab is never
+ * moved or freed whilst howm is running, so a client's address and index stay
+ * the same for as long as it is in use.
+ *
+ * Only the window index refers to clients by index. The list links between
+ * clients are still pointers, so the pool can't be dumped and restored as it
+ * is.
+ */
+struct client_pool {
+	Client **slabs; /**< Each slab is an array of CLIENT_SLAB_SIZE clients. */
+	unsigned int slab_cnt; /**< The amount of slabs. */
+	Client *free_list; /**< The unused clients, linked through next. */
+};
+
+/**
+ * @brief The rules, compiled into an Aho-Corasick automaton.
+ *
+ * Every rule's string is a pattern. Each state records, for every property,
+ * the lowest indexed rule that matches that property once the state has been
+ * reached. Finding a rule then takes one pass over each property, however
+ * many rules there are.
+ */
+struct rule_matcher {
+	uint8_t sym[256]; /**< Maps a byte to its column in next. Bytes that
+			    aren't in any pattern map to 0. */
+	unsigned int nsyms; /**< The amount of columns in next. */
+	unsigned int nstates; /**< The amount of states. State 0 is the root. */
+	unsigned int *next; /**< The transitions, nstates rows of nsyms. */
+	unsigned int *first; /**< nstates rows of END_PROP rule indices.
+			       LENGTH(rules) means that no rule matches. */
+};
+
+/**
+ * @brief A slot of the window index.
  *
- * TOP
- * ==========
- * c1->c2->c3->NULL
- * ==========
- * c1->NULL
- * ==========
- * c1->c2->c3->NULL
- * ==========
- * BOTTOM
+ * The window is kept next to the client's index, so that probing only reads
+ * the table and the client is only looked up once it has been found.
+ */
+struct win_slot {
+	xcb_window_t win; /**< The client's window. */
+	uint32_t id; /**< The client's pool index plus one, 0 for an empty slot. */
+};
+
+/**
+ * @brief An open addressing hash table that maps windows to the clients that
+ * are on a workspace.
  *
+ * Collisions are resolved with linear probing. Deleted entries are filled by
+ * shifting later entries back, so that no tombstones are needed.
+ */
+struct win_index {
+	struct win_slot *slots; /**< The slots, cap of them. */
+	unsigned int cap; /**< The amount of slots, always a power of two. */
+	unsigned int cnt; /**< The amount of slots that are in use. */
+	unsigned int shift; /**< How far a hash is shifted to fit in cap. */
+};
+
+
+/**
+ * @brief Represents the sequence numbers of the requests that howm sent
+ * whilst handling a single event, that may have moved a window under the
+ * pointer.
  */
-struct stack {
-	int size; /** The amount of items in the stack. */
-	Client **contents; /** The contents is an array of linked lists. Storage
-			is malloced later as we don't know the size yet.*/
+struct seq_range {
+	uint16_t first; /**< The sequence number of the first request. */
+	uint16_t end; /**< The sequence number of the marker request that was
+			sent after the last one. Events from the marker on
+			weren't caused by the range. */
 };
 
+/**
+ * @brief Represents a floating client that is being moved or resized using
+ * the mouse.
+ */
+struct drag_state {
+	Client *c; /**< The client being dragged. NULL when nothing is. */
+	bool resize; /**< Resize the client, rather than moving it. */
+	int16_t ptr_x; /**< The x coordinate of the pointer when the drag began. */
+	int16_t ptr_y; /**< The y coordinate of the pointer when the drag began. */
+	int16_t x; /**< The x coordinate of the client when the drag began. */
+	int16_t y; /**< The y coordinate of the client when the drag began. */
+	uint16_t w; /**< The width of the client when the drag began. */
+	uint16_t h; /**< The height of the client when the drag began. */
+};
 
 /* Operators */
 static void op_kill(const unsigned int type, int cnt);
@@ -216,10 +506,12 @@ static void op_focus_up(const unsigned int type, int cnt);
 static void op_shrink_gaps(const unsigned int type, int cnt);
 static void op_grow_gaps(const unsigned int type, int cnt);
 static void op_cut(const unsigned int type, int cnt);
+static Client *client_step(Client *c, int steps);
 
 /* Clients */
 static void teleport_client(const Arg *arg);
 static void change_client_gaps(Client *c, int size);
+static void update_frame_extents(Client *c);
 static void change_gaps(const unsigned int type, int cnt, int size);
 static void move_current_down(const Arg *arg);
 static void move_current_up(const Arg *arg);
@@ -230,27 +522,68 @@ static Client *next_client(Client *c);
 static void focus_next_client(const Arg *arg);
 static void focus_prev_client(const Arg *arg);
 static void update_focused_client(Client *c);
+static void restack_clients(void);
+static unsigned int stacking_order(int ws, xcb_window_t *wins);
+static unsigned int stacking_group(Client *c);
+static void regroup_client(Client *c, unsigned int old);
+static Client **ws_partition(int ws);
+static unsigned int part_len(int ws);
+static void focus_current_client(void);
+static void send_focus(void);
 static Client *prev_client(Client *c, int ws);
-static Client *create_client(xcb_window_t w);
+static void attach_client(int ws, Client *after, Client *c);
+static void detach_client(int ws, Client *c);
+static void attach_run(int ws, Client *after, Client *first, Client *last);
+static void detach_run(int ws, Client *first, Client *last);
+static void mru_add(int ws, Client *c);
+static void mru_del(int ws, Client *c);
+static void mru_touch(int ws, Client *c);
+static Client *mru_refill(int ws);
+static void end_mru_walk(void);
+static Client *prev_focus(int ws);
+static void focus_mru(const Arg *arg);
+static Client *client_at(int ws, int pos);
+static void place_client(int ws, Client *c, int p, int f);
+static Client *create_client(xcb_window_t w, int ws);
 static void remove_client(Client *c);
 static Client *find_client_by_win(xcb_window_t w);
+static int client_ws(Client *c);
 static void client_to_ws(Client *c, const int ws, bool follow);
 static void current_to_ws(const Arg *arg);
-static void draw_clients(void);
-static void change_client_geom(Client *c, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+static void draw_clients(int ws);
+static void change_client_geom(Client *c, int16_t x, int16_t y, uint16_t w, uint16_t h);
 static void toggle_float(const Arg *arg);
 static void resize_float_width(const Arg *arg);
 static void resize_float_height(const Arg *arg);
 static void move_float_y(const Arg *arg);
 static void move_float_x(const Arg *arg);
+static void mouse_move(const Arg *arg);
+static void mouse_resize(const Arg *arg);
+static void start_drag(bool resize);
+static void drag_to(int16_t x, int16_t y);
 static void make_master(const Arg *arg);
 static void grab_buttons(Client *c);
 static void set_fullscreen(Client *c, bool fscr);
 static void set_urgent(Client *c, bool urg);
+static void urgent_push(Client *c);
+static void urgent_unlink(Client *c);
 static void toggle_fullscreen(const Arg *arg);
 static void focus_urgent(const Arg *arg);
 static void send_to_scratchpad(const Arg *arg);
 static void get_from_scratchpad(const Arg *arg);
+static void toggle_scratchpad(const Arg *arg);
+static void stow_client(Client *c);
+static void unstow_client(Client *c, uint16_t w, uint16_t h);
+static void centre_float(Client *c, uint16_t w, uint16_t h);
+static int claim_scratchpad(char * const *props);
+static Client **stowed_slot(xcb_window_t win);
+static void drop_stowed(Client **slot);
+static void forget_scratchpad(Client *c);
+static void hide_client(Client *c);
+static void park_client(Client *c);
+static void unmap_client(Client *c);
+static void map_client(Client *c);
+static void show_client(Client *c);
 
 /* Workspaces */
 static void kill_ws(const int ws);
@@ -261,67 +594,133 @@ static void focus_prev_ws(const Arg *arg);
 static void focus_last_ws(const Arg *arg);
 static void change_ws(const Arg *arg);
 static int correct_ws(int ws);
+static bool ws_visible(int ws);
+static Monitor *ws_mon(int ws);
+static Monitor *ws_output(int ws);
+static xcb_rectangle_t ws_area(int ws);
+static void update_workarea(void);
+static void apply_pending(int ws);
+static void resize_wss(int n);
+static void set_ws_count(int n);
+static void merge_ws(int from, int to);
+static void update_busy(int ws);
 
 /* Layouts */
 static void change_layout(const Arg *arg);
 static void next_layout(const Arg *arg);
 static void previous_layout(const Arg *arg);
 static void last_layout(const Arg *arg);
-static void stack(void);
-static void grid(void);
-static void zoom(void);
+static void stack(int ws);
+static void grid(int ws);
+static void zoom(int ws);
 static void arrange_windows(void);
+static void arrange_ws(int ws);
 
 /* Modes */
 static void change_mode(const Arg *arg);
 
-/* Stack */
-static void stack_push(struct stack *s, Client *c);
-static Client *stack_pop(struct stack *s);
-static void stack_init(struct stack *s);
-static void stack_free(struct stack *s);
+/* Delete register */
+static void reg_push(struct cut_register *r, Client *head, Client *tail,
+		unsigned int cnt);
+static bool reg_pop(struct cut_register *r, struct segment *seg);
+static void reg_evict(struct cut_register *r);
+static void reg_close_evicted(struct cut_register *r);
+static struct segment *reg_find(struct cut_register *r, xcb_window_t win,
+		Client **cp);
+static void reg_forget(struct cut_register *r, struct segment *seg, Client *c);
+static void restore_run(int ws, Client *after, const struct segment *seg);
+static void reg_init(struct cut_register *r);
+static void reg_free(struct cut_register *r);
+
+/* Client pool */
+static Client *client_alloc(struct client_pool *cp);
+static void client_release(struct client_pool *cp, Client *c);
+static Client *client_by_id(const struct client_pool *cp, uint32_t id);
+static void client_pool_free(struct client_pool *cp);
+
+/* Window index */
+static void win_index_init(struct win_index *wi, unsigned int cap);
+static unsigned int win_index_slot(const struct win_index *wi, xcb_window_t win);
+static Client *win_index_at(const struct win_index *wi, unsigned int i);
+static void win_index_put(struct win_index *wi, Client *c);
+static void win_index_del(struct win_index *wi, xcb_window_t win);
+static Client *win_index_get(const struct win_index *wi, xcb_window_t win);
 
 /* Events */
 static void enter_event(xcb_generic_event_t *ev);
 static void destroy_event(xcb_generic_event_t *ev);
 static void button_press_event(xcb_generic_event_t *ev);
+static void button_release_event(xcb_generic_event_t *ev);
+static void motion_event(xcb_generic_event_t *ev);
 static void key_press_event(xcb_generic_event_t *ev);
 static void map_event(xcb_generic_event_t *ev);
+static void property_event(xcb_generic_event_t *ev);
 static void configure_event(xcb_generic_event_t *ev);
+static void send_configure_notify(Client *c);
 static void unmap_event(xcb_generic_event_t *ev);
 static void client_message_event(xcb_generic_event_t *ev);
+static void handle_event(xcb_generic_event_t *ev);
 
 /* XCB */
 static void grab_keys(void);
 static xcb_keycode_t *keysym_to_keycode(xcb_keysym_t sym);
 static void grab_keycode(xcb_keycode_t *keycode, const int mod);
 static void elevate_window(xcb_window_t win);
-static void move_resize(xcb_window_t win, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+static void move_resize(xcb_window_t win, int16_t x, int16_t y, uint16_t w, uint16_t h);
 static void set_border_width(xcb_window_t win, uint16_t w);
-static void get_atoms(char **names, xcb_atom_t *atoms);
+static void get_atoms(char **names, xcb_atom_t *atoms, unsigned int cnt);
 static void check_other_wm(void);
 static xcb_keysym_t keycode_to_keysym(xcb_keycode_t keycode);
 static void ewmh_process_wm_state(Client *c, xcb_atom_t a, int action);
+static void ewmh_set_wm_state(Client *c);
+static void note_layout_seq(xcb_void_cookie_t cookie);
+static void end_layout_seq(void);
+static bool caused_by_layout(uint16_t seq);
 
 /* Misc */
-static void apply_rules(Client *c);
+static const Rule *find_rule(char * const *props);
+static void build_matcher(struct rule_matcher *rm);
+static void free_matcher(struct rule_matcher *rm);
+static void fetch_props(xcb_window_t win, char **props, unsigned int which);
+static void free_props(char **props);
+static char *copy_prop(const char *s, unsigned int len);
+static void apply_rules(Client *c, const Rule *r);
 static void howm_info(void);
 static void save_last_ocm(void (*op) (const unsigned int, int), const unsigned int type, int cnt);
 static void save_last_cmd(void (*cmd)(const Arg *), const Arg *arg);
 static void replay(const Arg *arg);
+static void toggle_recording(const Arg *arg);
+static void play_macro(const Arg *arg);
+static void record_step(void (*cmd)(const Arg *), const Arg *arg,
+		void (*op)(const unsigned int, int), unsigned int type, int cnt);
+static void txn_begin(void);
+static void txn_commit(void);
 static void paste(const Arg *arg);
-static int get_non_tff_count(void);
-static Client *get_first_non_tff(void);
+static unsigned int gather_tiles(int ws);
+static void draw_tiles(int ws, unsigned int n);
+static void inset_tiles(int16_t *restrict x, int16_t *restrict y,
+		uint16_t *restrict w, uint16_t *restrict h,
+		const uint16_t *restrict g, unsigned int n, uint16_t off, uint16_t bw);
+static void draw_client(int ws, Client *c);
+static xcb_rectangle_t client_frame(int ws, const Client *c, uint16_t *bw);
+static bool memo_restore(int ws, int layout, unsigned int n, xcb_rectangle_t r);
+static void memo_store(int ws, int layout, unsigned int n, xcb_rectangle_t r);
 static uint32_t get_colour(char *colour);
 static void spawn(const Arg *arg);
 static void setup(void);
+static void setup_monitors(void);
+static Monitor *find_outputs(unsigned int *cnt, unsigned int *primary);
+static void update_outputs(void);
 static void move_client(int cnt, bool up);
 static void focus_window(xcb_window_t win);
 static void quit_howm(const Arg *arg);
 static void restart_howm(const Arg *arg);
 static void cleanup(void);
 static void delete_win(xcb_window_t win);
+static void close_win(xcb_window_t win);
 static void setup_ewmh(void);
+static void ewmh_append_client(Client *c);
+static void ewmh_update_client_lists(void);
 
 enum layouts { ZOOM, GRID, HSTACK, VSTACK, END_LAYOUT };
 enum states { OPERATOR_STATE, COUNT_STATE, MOTION_STATE, END_STATE };
@@ -329,22 +728,26 @@ enum modes { NORMAL, FOCUS, FLOATING, END_MODES };
 enum motions { CLIENT, WORKSPACE };
 enum net_atom_enum { NET_WM_STATE_FULLSCREEN, NET_SUPPORTED, NET_WM_STATE,
 	NET_ACTIVE_WINDOW };
-enum wm_atom_enum { WM_DELETE_WINDOW, WM_PROTOCOLS };
+enum wm_atom_enum { WM_DELETE_WINDOW, WM_PROTOCOLS, WM_WINDOW_ROLE };
+enum rule_keys { MATCH_NAME, MATCH_INSTANCE, MATCH_CLASS, MATCH_TITLE, MATCH_ROLE };
 enum teleport_locations { TOP_LEFT, TOP_CENTER, TOP_RIGHT, CENTER, BOTTOM_LEFT, BOTTOM_CENTER, BOTTOM_RIGHT };
 
 /* Handlers */
 static void(*handler[XCB_NO_OPERATION]) (xcb_generic_event_t *) = {
 	[XCB_BUTTON_PRESS] = button_press_event,
+	[XCB_BUTTON_RELEASE] = button_release_event,
+	[XCB_MOTION_NOTIFY] = motion_event,
 	[XCB_KEY_PRESS] = key_press_event,
 	[XCB_MAP_REQUEST] = map_event,
 	[XCB_DESTROY_NOTIFY] = destroy_event,
 	[XCB_ENTER_NOTIFY] = enter_event,
-	[XCB_CONFIGURE_NOTIFY] = configure_event,
+	[XCB_CONFIGURE_REQUEST] = configure_event,
 	[XCB_UNMAP_NOTIFY] = unmap_event,
+	[XCB_PROPERTY_NOTIFY] = property_event,
 	[XCB_CLIENT_MESSAGE] = client_message_event
 };
 
-static void(*layout_handler[]) (void) = {
+static void(*layout_handler[]) (int ws) = {
 	[GRID] = grid,
 	[ZOOM] = zoom,
 	[HSTACK] = stack,
@@ -356,9 +759,21 @@ static void(*layout_handler[]) (void) = {
 static void (*operator_func)(const unsigned int type, int cnt);
 
 static Client *scratchpad;
-static struct stack del_reg;
+static Client *mru_walk;
+static struct urgent_queue urgent;
+static struct scratch_slot scratch[LENGTH(scratchpads)];
+static struct cut_register del_reg;
+static Workspace *wss;
+static int ws_cnt, *busy_ws;
+static unsigned int busy_cnt;
+static struct client_pool clients;
+static struct tiles tiles;
+static unsigned long memo_hits, memo_misses;
+static struct win_index clients_by_win;
+static struct rule_matcher matcher;
 static xcb_connection_t *dpy;
-static char *WM_ATOM_NAMES[] = { "WM_DELETE_WINDOW", "WM_PROTOCOLS" };
+static char *WM_ATOM_NAMES[] = { "WM_DELETE_WINDOW", "WM_PROTOCOLS",
+	"WM_WINDOW_ROLE" };
 static xcb_atom_t wm_atoms[LENGTH(WM_ATOM_NAMES)];
 static xcb_screen_t *screen;
 static xcb_ewmh_connection_t *ewmh;
@@ -366,9 +781,21 @@ static int numlockmask, retval, last_ws, prev_layout, cw = DEFAULT_WORKSPACE;
 static uint32_t border_focus, border_unfocus, border_prev_focus, border_urgent;
 static unsigned int cur_mode, cur_state = OPERATOR_STATE, cur_cnt = 1;
 static uint16_t screen_height, screen_width;
+static Monitor *mons;
+static unsigned int mon_cnt, cur_mon;
+static int randr_base = -1;
+static bool outputs_changed;
 static bool running = true, restart;
+static bool client_list_dirty = true, stacking_dirty = true;
 
 static struct replay_state rep_state;
+static struct macro macros[MACRO_REGISTERS];
+static struct transaction txn;
+static int recording = -1, macro_cnt;
+static struct drag_state drag;
+static struct seq_range layout_seqs[LAYOUT_SEQ_RANGES];
+static unsigned int layout_seq_idx;
+static bool layout_seq_open;
 
 /* Add comments so that splint ignores this as it doesn't support variadic
  * macros.
@@ -434,10 +861,12 @@ void setup(void)
 
 	log_info("Screen's height is: %d", screen_height);
 	log_info("Screen's width is: %d", screen_width);
+	resize_wss(WORKSPACES);
+	setup_monitors();
 
 	grab_keys();
 
-	get_atoms(WM_ATOM_NAMES, wm_atoms);
+	get_atoms(WM_ATOM_NAMES, wm_atoms, LENGTH(WM_ATOM_NAMES));
 
 	setup_ewmh();
 
@@ -445,8 +874,221 @@ void setup(void)
 	border_unfocus = get_colour(BORDER_UNFOCUS);
 	border_prev_focus = get_colour(BORDER_PREV_FOCUS);
 	border_urgent = get_colour(BORDER_URGENT);
-	stack_init(&del_reg);
+	reg_init(&del_reg);
+	win_index_init(&clients_by_win, WIN_INDEX_MIN);
+	build_matcher(&matcher);
+
+	howm_info();
+}
+
+/**
+ * @brief Find the outputs that are connected and give each of them a
+ * workspace to show.
+ *
+ * howm also asks to be told about changes to the outputs, so that it can
+ * keep up with monitors being plugged in or the resolution being changed.
+ */
+static void setup_monitors(void)
+{
+	const xcb_query_extension_reply_t *ext = xcb_get_extension_data(dpy, &xcb_randr_id);
+	unsigned int i;
+
+	if (ext && ext->present) {
+		randr_base = ext->first_event;
+		xcb_randr_select_input(dpy, screen->root,
+				XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE
+				| XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE
+				| XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+	}
+	mons = find_outputs(&mon_cnt, &cur_mon);
+	for (i = 0; i < mon_cnt; i++) {
+		mons[i].ws = correct_ws(DEFAULT_WORKSPACE + ((i + mon_cnt - cur_mon) % mon_cnt));
+		log_info("Output %u is %ux%u+%d+%d showing workspace <%d>", i,
+				mons[i].w, mons[i].h, mons[i].x, mons[i].y, mons[i].ws);
+	}
+}
+
+/**
+ * @brief Ask RandR for the outputs that are connected.
+ *
+ * Outputs that clone another output are only counted once. If RandR isn't
+ * available, the whole screen is treated as a single output. The workspace
+ * of each output is left for the caller to fill in.
+ *
+ * @param cnt Where the number of outputs will be stored.
+ * @param primary Where the index of the primary output will be stored.
+ *
+ * @return An array of outputs, which must be freed by the caller.
+ */
+static Monitor *find_outputs(unsigned int *cnt, unsigned int *primary)
+{
+	xcb_randr_get_screen_resources_current_reply_t *res = NULL;
+	xcb_randr_get_output_primary_reply_t *pri = NULL;
+	xcb_randr_get_output_info_reply_t *oi;
+	xcb_randr_get_crtc_info_reply_t *ci;
+	xcb_randr_output_t *outputs, pri_out = XCB_NONE;
+	unsigned int i, j, n = 0, len = 0;
+	Monitor *m;
+
+	*primary = 0;
+	if (randr_base >= 0) {
+		pri = xcb_randr_get_output_primary_reply(dpy,
+				xcb_randr_get_output_primary(dpy, screen->root), NULL);
+		res = xcb_randr_get_screen_resources_current_reply(dpy,
+				xcb_randr_get_screen_resources_current(dpy, screen->root), NULL);
+	}
+	if (pri)
+		pri_out = pri->output;
+	free(pri);
+	if (res)
+		len = xcb_randr_get_screen_resources_current_outputs_length(res);
+
+	m = calloc(len > 0 ? len : 1, sizeof(Monitor));
+	if (!m) {
+		log_err("Can't allocate memory for outputs.");
+		exit(EXIT_FAILURE);
+	}
+
+	if (res) {
+		outputs = xcb_randr_get_screen_resources_current_outputs(res);
+		xcb_randr_get_output_info_cookie_t ocookies[len];
+
+		for (i = 0; i < len; i++)
+			ocookies[i] = xcb_randr_get_output_info(dpy, outputs[i], res->config_timestamp);
+		for (i = 0; i < len; i++) {
+			oi = xcb_randr_get_output_info_reply(dpy, ocookies[i], NULL);
+			if (!oi || oi->connection != XCB_RANDR_CONNECTION_CONNECTED
+					|| oi->crtc == XCB_NONE || n >= (unsigned int)ws_cnt) {
+				free(oi);
+				continue;
+			}
+			ci = xcb_randr_get_crtc_info_reply(dpy, xcb_randr_get_crtc_info(dpy,
+						oi->crtc, res->config_timestamp), NULL);
+			free(oi);
+			if (!ci)
+				continue;
+			for (j = 0; j < n; j++)
+				if (m[j].x == ci->x && m[j].y == ci->y
+						&& m[j].w == ci->width
+						&& m[j].h == ci->height)
+					break;
+			if (j == n) {
+				m[n].x = ci->x;
+				m[n].y = ci->y;
+				m[n].w = ci->width;
+				m[n].h = ci->height;
+				m[n].bar_height = BAR_ON_ALL_OUTPUTS ? BAR_HEIGHT : 0;
+				if (outputs[i] == pri_out)
+					*primary = n;
+				n++;
+			}
+			free(ci);
+		}
+		free(res);
+	}
+
+	if (n == 0) {
+		log_warn("No outputs found using RandR, using the whole screen.");
+		m[0].w = screen_width;
+		m[0].h = screen_height;
+		n = 1;
+	}
+	m[*primary].bar_height = BAR_HEIGHT;
+	*cnt = n;
+	return m;
+}
+
+/**
+ * @brief Bring howm up to date after the outputs have changed.
+ *
+ * Each output keeps showing the workspace that was on the output at the same
+ * position. Workspaces from outputs that have gone are moved onto new
+ * outputs where possible, otherwise they are hidden. Any output that is left
+ * over shows the first hidden workspace.
+ *
+ * Only the visible workspaces whose area has changed are arranged now. The
+ * hidden workspaces are marked dirty, so that they are fixed up the next
+ * time that they are shown.
+ */
+static void update_outputs(void)
+{
+	Monitor *old = mons, *m;
+	unsigned int old_cnt = mon_cnt, old_cur = cur_mon, i, j;
+	bool claimed[old_cnt], same;
+	xcb_get_geometry_reply_t *geom;
+	int w;
+	Client *c;
+
+	outputs_changed = false;
+	geom = xcb_get_geometry_reply(dpy, xcb_get_geometry(dpy, screen->root), NULL);
+	if (geom) {
+		screen_width = geom->width;
+		screen_height = geom->height;
+		free(geom);
+	}
+	mons = find_outputs(&mon_cnt, &cur_mon);
+	log_info("Outputs have changed, there are now %u", mon_cnt);
+
+	memset(claimed, 0, sizeof(claimed));
+	for (i = 0; i < mon_cnt; i++)
+		for (j = 0; j < old_cnt && !mons[i].ws; j++)
+			if (!claimed[j] && old[j].x == mons[i].x && old[j].y == mons[i].y) {
+				mons[i].ws = old[j].ws;
+				claimed[j] = true;
+			}
+	for (i = 0; i < mon_cnt; i++)
+		for (j = 0; j < old_cnt && !mons[i].ws; j++)
+			if (!claimed[j]) {
+				mons[i].ws = old[j].ws;
+				claimed[j] = true;
+			}
+	for (i = 0; i < mon_cnt; i++)
+		for (w = 1; w <= ws_cnt && !mons[i].ws; w++)
+			if (!ws_mon(w))
+				mons[i].ws = w;
+
+	for (i = 0; i < mon_cnt; i++) {
+		if (mons[i].ws == old[old_cur].ws)
+			cur_mon = i;
+		for (j = 0, same = false; j < old_cnt && !same; j++)
+			same = old[j].ws == mons[i].ws && old[j].x == mons[i].x
+				&& old[j].y == mons[i].y && old[j].w == mons[i].w
+				&& old[j].h == mons[i].h
+				&& old[j].bar_height == mons[i].bar_height;
+		log_info("Output %u is %ux%u+%d+%d showing workspace <%d>", i,
+				mons[i].w, mons[i].h, mons[i].x, mons[i].y, mons[i].ws);
+		if (same)
+			continue;
+		wss[mons[i].ws].dirty = true;
+		apply_pending(mons[i].ws);
+		arrange_ws(mons[i].ws);
+		for (c = wss[mons[i].ws].head; c; c = c->next)
+			show_client(c);
+	}
+	for (w = 1; w <= ws_cnt; w++) {
+		if (ws_mon(w))
+			continue;
+		wss[w].dirty = true;
+		for (j = 0; j < old_cnt; j++)
+			if (!claimed[j] && old[j].ws == w)
+				for (c = wss[w].head; c; c = c->next)
+					hide_client(c);
+	}
+	free(old);
 
+	m = &mons[cur_mon];
+	if (m->ws != cw) {
+		last_ws = cw;
+		cw = m->ws;
+	}
+	if (wss[cw].current) {
+		restack_clients();
+		focus_current_client();
+	}
+	stacking_dirty = true;
+	xcb_ewmh_set_current_desktop(ewmh, 0, cw - 1);
+	xcb_ewmh_set_desktop_geometry(ewmh, 0, screen_width, screen_height);
+	update_workarea();
 	howm_info();
 }
 
@@ -501,11 +1143,19 @@ int main(int argc, char *argv[])
 		if (!xcb_flush(dpy))
 			log_err("Failed to flush X connection");
 		ev = xcb_wait_for_event(dpy);
-		if (ev && handler[ev->response_type & ~0x80])
-			handler[ev->response_type & ~0x80](ev);
-		else
-			log_debug("Unimplemented event: %d", ev->response_type & ~0x80);
-		free(ev);
+		/* Handle every event that has already arrived before
+		 * updating the client lists and flushing. */
+		while (ev) {
+			handle_event(ev);
+			end_layout_seq();
+			free(ev);
+			ev = xcb_poll_for_queued_event(dpy);
+		}
+		if (outputs_changed) {
+			update_outputs();
+			end_layout_seq();
+		}
+		ewmh_update_client_lists();
 	}
 	if (!running && !restart) {
 		cleanup();
@@ -521,6 +1171,28 @@ int main(int argc, char *argv[])
 	return EXIT_FAILURE;
 }
 
+/**
+ * @brief Pass an event to its handler.
+ *
+ * @param ev The event to be handled.
+ */
+static void handle_event(xcb_generic_event_t *ev)
+{
+	int type = ev->response_type & ~0x80;
+
+	/* RandR's events don't have a fixed number, so they can't be put in
+	 * the handler table. A burst of them is sent for a single change, so
+	 * they are only noted here and dealt with once the burst is over. */
+	if (randr_base >= 0 && (type == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY
+				|| type == randr_base + XCB_RANDR_NOTIFY)) {
+		log_debug("Received RandR event: %d", type - randr_base);
+		outputs_changed = true;
+	} else if (handler[ev->response_type & ~0x80])
+		handler[ev->response_type & ~0x80](ev);
+	else
+		log_debug("Unimplemented event: %d", ev->response_type & ~0x80);
+}
+
 /**
  * @brief Try to detect if another WM exists.
  *
@@ -550,14 +1222,30 @@ void check_other_wm(void)
 /**
  * @brief Process a button press.
  *
+ * Presses that match an entry in buttons call its function and aren't passed
+ * on to the client.
+ *
  * @param ev The button press event.
  */
 void button_press_event(xcb_generic_event_t *ev)
 {
 	/* FIXME: be->event doesn't seem to match with any windows managed by howm.*/
 	xcb_button_press_event_t *be = (xcb_button_press_event_t *)ev;
+	unsigned int i;
 
 	log_info("Button %d pressed at (%d, %d)", be->detail, be->event_x, be->event_y);
+	for (i = 0; i < LENGTH(buttons); i++) {
+		if (be->detail == buttons[i].button
+				&& EQUALMODS(buttons[i].mod, be->state)) {
+			drag.c = find_client_by_win(be->event);
+			drag.ptr_x = be->root_x;
+			drag.ptr_y = be->root_y;
+			buttons[i].func(&buttons[i].arg);
+			xcb_allow_events(dpy, XCB_ALLOW_ASYNC_POINTER, be->time);
+			return;
+		}
+	}
+
 	if (FOCUS_MOUSE_CLICK && be->detail == XCB_BUTTON_INDEX_1)
 		focus_window(be->event);
 
@@ -567,6 +1255,51 @@ void button_press_event(xcb_generic_event_t *ev)
 	}
 }
 
+/**
+ * @brief Finish moving or resizing a client with the mouse.
+ *
+ * @param ev The button release event.
+ */
+static void button_release_event(xcb_generic_event_t *ev)
+{
+	UNUSED(ev);
+	if (!drag.c)
+		return;
+	log_info("Finished dragging client <%p>", drag.c);
+	drag.c = NULL;
+	xcb_ungrab_pointer(dpy, XCB_CURRENT_TIME);
+}
+
+/**
+ * @brief Move or resize the client being dragged to follow the pointer.
+ *
+ * Only the newest of the queued motion events is acted upon, so that a
+ * single ConfigureWindow is sent for each batch of motion.
+ *
+ * @param ev The motion event.
+ */
+static void motion_event(xcb_generic_event_t *ev)
+{
+	xcb_motion_notify_event_t *me = (xcb_motion_notify_event_t *)ev;
+	xcb_generic_event_t *next;
+	int16_t x = me->root_x, y = me->root_y;
+
+	if (!drag.c)
+		return;
+	while ((next = xcb_poll_for_event(dpy))) {
+		if ((next->response_type & ~0x80) != XCB_MOTION_NOTIFY)
+			break;
+		x = ((xcb_motion_notify_event_t *)next)->root_x;
+		y = ((xcb_motion_notify_event_t *)next)->root_y;
+		free(next);
+	}
+	drag_to(x, y);
+	if (next) {
+		handle_event(next);
+		free(next);
+	}
+}
+
 /**
  * @brief Process a key press.
  *
@@ -592,6 +1325,12 @@ void key_press_event(xcb_generic_event_t *ev)
 	keysym = keycode_to_keysym(ke->detail);
 	switch (cur_state) {
 	case OPERATOR_STATE:
+		if (EQUALMODS(COUNT_MOD, ke->state) && XK_1 <= keysym
+				&& keysym <= XK_9) {
+			/* A count on its own is for the next macro played. */
+			macro_cnt = keysym - XK_0;
+			break;
+		}
 		for (i = 0; i < LENGTH(operators); i++) {
 			if (keysym == operators[i].sym && EQUALMODS(operators[i].mod, ke->state)
 			    && operators[i].mode == cur_mode) {
@@ -623,8 +1362,12 @@ void key_press_event(xcb_generic_event_t *ev)
 	for (i = 0; i < LENGTH(keys); i++)
 		if (keysym == keys[i].sym && EQUALMODS(keys[i].mod, ke->state)
 		    && keys[i].func && keys[i].mode == cur_mode) {
+			if (keys[i].func != focus_mru)
+				end_mru_walk();
+			if (keys[i].func != play_macro)
+				macro_cnt = 0;
 			keys[i].func(&keys[i].arg);
-			if (keys[i].func != replay)
+			if (keys[i].func != replay && keys[i].func != toggle_recording)
 				save_last_cmd(keys[i].func, &keys[i].arg);
 		}
 }
@@ -650,8 +1393,12 @@ void spawn(const Arg *arg)
  *
  * When an X window wishes to be displayed, it send a mapping request. This
  * function processes that mapping request and inserts the new client (created
- * from the map requesting window) into the list of clients for the current
- * workspace.
+ * from the map requesting window) into the list of clients for the workspace
+ * that its rule sends it to, or the current workspace if it has no rule.
+ *
+ * Rules and the layout are applied before the window is mapped, so that it
+ * is only mapped once and at its final geometry. A window that is sent to a
+ * hidden workspace isn't mapped until that workspace is shown.
  *
  * @param ev A mapping request event.
  */
@@ -662,7 +1409,12 @@ void map_event(xcb_generic_event_t *ev)
 	xcb_get_window_attributes_reply_t *wa;
 	xcb_map_request_event_t *me = (xcb_map_request_event_t *)ev;
 	xcb_ewmh_get_atoms_reply_t type;
+	const Rule *r;
+	char *props[END_PROP];
+	xcb_rectangle_t area;
+	bool floating = false;
 	unsigned int i;
+	int ws, sp;
 	Client *c;
 
 	wa = xcb_get_window_attributes_reply(dpy, xcb_get_window_attributes(dpy, me->window), NULL);
@@ -674,8 +1426,6 @@ void map_event(xcb_generic_event_t *ev)
 
 	log_info("Mapping request for window <%d>", me->window);
 
-	c = create_client(me->window);
-
 	if (xcb_ewmh_get_wm_window_type_reply(ewmh,
 				xcb_ewmh_get_wm_window_type(ewmh, me->window),
 				&type, NULL) == 1) {
@@ -684,6 +1434,9 @@ void map_event(xcb_generic_event_t *ev)
 
 			if (a == ewmh->_NET_WM_WINDOW_TYPE_DOCK
 				|| a == ewmh->_NET_WM_WINDOW_TYPE_TOOLBAR) {
+				/* Docks aren't managed, just shown. */
+				xcb_ewmh_get_atoms_reply_wipe(&type);
+				xcb_map_window(dpy, me->window);
 				return;
 			} else if (a == ewmh->_NET_WM_WINDOW_TYPE_NOTIFICATION
 				|| a == ewmh->_NET_WM_WINDOW_TYPE_DROPDOWN_MENU
@@ -691,56 +1444,102 @@ void map_event(xcb_generic_event_t *ev)
 				|| a == ewmh->_NET_WM_WINDOW_TYPE_POPUP_MENU
 				|| a == ewmh->_NET_WM_WINDOW_TYPE_TOOLTIP
 				|| a == ewmh->_NET_WM_WINDOW_TYPE_DIALOG) {
-				c->is_floating = true;
+				floating = true;
 			}
 		}
+		xcb_ewmh_get_atoms_reply_wipe(&type);
 	}
 
+	memset(props, 0, sizeof(props));
+	fetch_props(me->window, props, (1 << END_PROP) - 1);
+	r = find_rule(props);
+	sp = claim_scratchpad(props);
+	ws = (r && r->ws > 0 && r->ws <= ws_cnt && sp < 0) ? r->ws : cw;
+	c = create_client(me->window, ws);
+	memcpy(c->props, props, sizeof(props));
+	c->is_floating = floating;
 
 	/* Assume that transient windows MUST float. */
 	xcb_icccm_get_wm_transient_for_reply(dpy, xcb_icccm_get_wm_transient_for_unchecked(dpy, me->window), &transient, NULL);
 	c->is_transient = transient ? true : false;
 	if (c->is_transient)
 		c->is_floating = true;
+	regroup_client(c, 0);
 
 	geom = xcb_get_geometry_reply(dpy, xcb_get_geometry_unchecked(dpy, me->window), NULL);
 	if (geom) {
 		log_info("Mapped client's initial geom is %ux%u+%d+%d", geom->width, geom->height, geom->x, geom->y);
 		if (c->is_floating) {
+			area = ws_area(ws);
 			c->w = geom->width > 1 ? geom->width : FLOAT_SPAWN_WIDTH;
 			c->h = geom->height > 1 ? geom->height : FLOAT_SPAWN_HEIGHT;
-			c->x = CENTER_FLOATING ? (screen_width / 2) - (c->w / 2) : geom->x;
-			c->y = CENTER_FLOATING ? (screen_height - wss[cw].bar_height - c->h) / 2 : geom->y;
+			c->x = CENTER_FLOATING ? area.x + (area.width - c->w) / 2 : geom->x;
+			c->y = CENTER_FLOATING ? area.y + (area.height - c->h) / 2 : geom->y;
 		}
 		free(geom);
 	}
 
+	apply_rules(c, r);
+	if (sp >= 0) {
+		log_info("Client <%p> is scratchpad <%s>", c, scratchpads[sp].name);
+		scratch[sp].c = c;
+		c->scratch_id = sp + 1;
+		centre_float(c, scratchpads[sp].w, scratchpads[sp].h);
+	}
 	grab_buttons(c);
-	xcb_map_window(dpy, c->win);
-	apply_rules(c);
+	wss[ws].current = c;
+	mru_touch(ws, c);
+
+	if (!ws_visible(ws)) {
+		log_info("Client <%p> is on hidden workspace <%d>", c, ws);
+		wss[ws].dirty = true;
+		if (PARK_WORKSPACES) {
+			hide_client(c);
+			map_client(c);
+		}
+		if (r && r->follow)
+			change_ws(&(Arg){ .i = ws });
+		return;
+	}
+
+	if (ws != cw) {
+		log_info("Client <%p> is on workspace <%d> on another output", c, ws);
+		arrange_ws(ws);
+		map_client(c);
+		if (r && r->follow)
+			focus_window(c->win);
+		return;
+	}
+
+	restack_clients();
 	arrange_windows();
-	update_focused_client(c);
+	map_client(c);
+	focus_current_client();
 }
 
 /**
- * @brief Search workspaces for a window, returning the client that it belongs
- * to.
+ * @brief Find the client that a window belongs to, across all workspaces.
  *
- * @param win A valid XCB window that is used when searching all clients across
- * all desktops.
+ * @param win A valid XCB window.
  *
- * @return The found client.
+ * @return The found client, or NULL if the window isn't a client on any
+ * workspace.
  */
 Client *find_client_by_win(xcb_window_t win)
 {
-	bool found;
-	int w = 1;
-	Client *c = NULL;
+	return win_index_get(&clients_by_win, win);
+}
 
-	for (found = false; w <= WORKSPACES && !found; w++)
-		for (c = wss[w].head; c && !(found = (win == c->win)); c = c->next)
-			;
-	return c;
+/**
+ * @brief Find the workspace that a client belongs to.
+ *
+ * @param c The client whose workspace should be found.
+ *
+ * @return The workspace that the client is on, or 0 if it isn't on any.
+ */
+static int client_ws(Client *c)
+{
+	return c ? c->ws : 0;
 }
 
 /**
@@ -793,112 +1592,372 @@ xcb_keycode_t *keysym_to_keycode(xcb_keysym_t sym)
  */
 Client *prev_client(Client *c, int ws)
 {
-	Client *p = NULL;
-
 	if (!c || !wss[ws].head || !wss[ws].head->next)
 		return NULL;
-	for (p = wss[ws].head; p->next && p->next != c; p = p->next)
-		;
-	return p;
+	return c->prev ? c->prev : wss[ws].tail;
 }
 
 /**
- * @brief Find the next client.
- *
- * Note: This function wraps around the end of the list of clients. If c is the
- * last item in the list of clients, then the head of the list is returned.
+ * @brief Insert a client into a workspace's client list.
  *
- * @param c The client which needs to have its next found.
+ * The focus history is left alone, so that reordering a client doesn't
+ * change it. Callers that bring a client onto the workspace must add it
+ * themselves.
  *
- * @return The next client, if c is the last client in the list then this will
- * be head. If c is NULL or there is only one client in the client list, NULL
- * will be returned.
+ * @param ws The workspace whose client list the client should be inserted
+ * into.
+ * @param after The client that c should be placed after. If NULL, c becomes
+ * the head of the list.
+ * @param c The client to be inserted.
  */
-Client *next_client(Client *c)
+static void attach_client(int ws, Client *after, Client *c)
 {
-	if (!c || !wss[cw].head	|| !wss[cw].head->next)
-		return NULL;
+	c->prev = after;
+	c->next = after ? after->next : wss[ws].head;
 	if (c->next)
-		return c->next;
-	return wss[cw].head;
+		c->next->prev = c;
+	else
+		wss[ws].tail = c;
+	if (after)
+		after->next = c;
+	else
+		wss[ws].head = c;
+	wss[ws].group_cnt[stacking_group(c)]++;
+	wss[ws].urgent_cnt += c->is_urgent;
+	wss[ws].part_dirty = true;
+	update_busy(ws);
 }
 
 /**
- * @brief Call the appropriate layout handler for each layout.
+ * @brief Take a client out of a workspace's client list.
+ *
+ * The client's own links are cleared, but nothing else about the workspace
+ * (such as its focus or focus history) is changed.
+ *
+ * @param ws The workspace whose client list contains c.
+ * @param c The client to be taken out.
  */
-void arrange_windows(void)
+static void detach_client(int ws, Client *c)
 {
-	if (!wss[cw].head)
-		return;
-	log_debug("Arranging windows");
-	layout_handler[wss[cw].head->next ? wss[cw].layout : ZOOM]();
-	howm_info();
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		wss[ws].head = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		wss[ws].tail = c->prev;
+	c->next = c->prev = NULL;
+	wss[ws].group_cnt[stacking_group(c)]--;
+	wss[ws].urgent_cnt -= c->is_urgent;
+	wss[ws].part_dirty = true;
+	update_busy(ws);
 }
 
 /**
- * @brief Arrange the windows into a grid layout.
+ * @brief Insert a run of linked clients into a workspace's client list.
+ *
+ * Only the links are changed, the caller must account for each client in the
+ * workspace's counts (including urgent_cnt) and focus history (it has to
+ * visit them anyway, to map them).
+ *
+ * @param ws The workspace whose client list the run should be inserted into.
+ * @param after The client that the run should be placed after. If NULL, the
+ * run is placed at the head of the list.
+ * @param first The first client of the run.
+ * @param last The last client of the run.
  */
-void grid(void)
+static void attach_run(int ws, Client *after, Client *first, Client *last)
 {
-	int n = get_non_tff_count();
-	Client *c = NULL;
-	int cols, rows, i = -1, col_cnt = 0, row_cnt = 0;
-	uint16_t col_w;
-	uint16_t client_y = BAR_BOTTOM ? 0 : wss[cw].bar_height;
-	uint16_t col_h = screen_height - wss[cw].bar_height;
-
-	if (n <= 1) {
-		zoom();
-		return;
-	}
-
-	log_info("Arranging %d clients in grid layout", n);
-
-	for (cols = 0; cols <= n / 2; cols++)
-		if (cols * cols >= n)
-			break;
-	rows = n / cols;
-	col_w = screen_width / cols;
-	for (c = wss[cw].head; c; c = c->next) {
-		if (FFT(c))
-			continue;
-		else
-			i++;
-
-		if (cols - (n % cols) < (i / rows) + 1)
-			rows = n / cols + 1;
-		change_client_geom(c, col_cnt * col_w, client_y + (row_cnt * col_h / rows),
-				col_w, (col_h / rows));
-		if (++row_cnt >= rows) {
-			row_cnt = 0;
-			col_cnt++;
-		}
-	}
-	draw_clients();
+	first->prev = after;
+	last->next = after ? after->next : wss[ws].head;
+	if (last->next)
+		last->next->prev = last;
+	else
+		wss[ws].tail = last;
+	if (after)
+		after->next = first;
+	else
+		wss[ws].head = first;
+	wss[ws].part_dirty = true;
+	update_busy(ws);
 }
 
 /**
- * @brief Have one window at a time taking up the entire screen.
+ * @brief Take a run of clients out of a workspace's client list.
  *
- * Sets the geometry of each window in order for the windows to be rendered to
- * take up the entire screen.
+ * The run keeps its internal links. As with attach_run(), the workspace's
+ * counts and focus history are left to the caller.
+ *
+ * @param ws The workspace whose client list contains the run.
+ * @param first The first client of the run.
+ * @param last The last client of the run, which must not come before first.
  */
-void zoom(void)
+static void detach_run(int ws, Client *first, Client *last)
 {
-	Client *c;
+	if (first->prev)
+		first->prev->next = last->next;
+	else
+		wss[ws].head = last->next;
+	if (last->next)
+		last->next->prev = first->prev;
+	else
+		wss[ws].tail = first->prev;
+	first->prev = last->next = NULL;
+	wss[ws].part_dirty = true;
+	update_busy(ws);
+}
 
-	log_info("Arranging clients in zoom format");
-	/* When zoom is called because there aren't enough clients for other
+/**
+ * @brief Add a client to a workspace's focus history, as the least recently
+ * focused client.
+ *
+ * If the history already holds MRU_HISTORY clients, c is left out of it until
+ * it is focused.
+ *
+ * @param ws The workspace that c has been placed on.
+ * @param c The client to be added.
+ */
+static void mru_add(int ws, Client *c)
+{
+	Client *h = wss[ws].mru;
+
+	if (!h) {
+		c->mru_next = c->mru_prev = c;
+		wss[ws].mru = c;
+		wss[ws].mru_cnt = 1;
+		return;
+	}
+	if (wss[ws].mru_cnt >= MRU_HISTORY)
+		return;
+	c->mru_next = h;
+	c->mru_prev = h->mru_prev;
+	h->mru_prev->mru_next = c;
+	h->mru_prev = c;
+	wss[ws].mru_cnt++;
+}
+
+/**
+ * @brief Take a client out of a workspace's focus history.
+ *
+ * @param ws The workspace that c is being taken from.
+ * @param c The client to be taken out.
+ */
+static void mru_del(int ws, Client *c)
+{
+	if (c == mru_walk)
+		mru_walk = NULL;
+	if (!c->mru_next)
+		return;
+	wss[ws].mru_cnt--;
+	if (c->mru_next == c) {
+		wss[ws].mru = NULL;
+	} else {
+		c->mru_prev->mru_next = c->mru_next;
+		c->mru_next->mru_prev = c->mru_prev;
+		if (wss[ws].mru == c)
+			wss[ws].mru = c->mru_next;
+	}
+	c->mru_next = c->mru_prev = NULL;
+}
+
+/**
+ * @brief Mark a client as the most recently focused on its workspace.
+ *
+ * If the history is full, its least recently focused client falls out of it.
+ *
+ * @param ws The workspace that c is on.
+ * @param c The client that has been focused.
+ */
+static void mru_touch(int ws, Client *c)
+{
+	if (wss[ws].mru == c)
+		return;
+	if (c->mru_next)
+		mru_del(ws, c);
+	else if (wss[ws].mru_cnt >= MRU_HISTORY)
+		mru_del(ws, wss[ws].mru->mru_prev);
+	mru_add(ws, c);
+	wss[ws].mru = c;
+}
+
+/**
+ * @brief Top up a workspace's focus history after clients have left it.
+ *
+ * Clients that had fallen out of the history are added back, in the order of
+ * the client list, until it is full again. This keeps the history from
+ * running dry whilst the workspace still has clients.
+ *
+ * @param ws The workspace whose client list has just lost clients.
+ *
+ * @return The most recently focused client, or NULL if the workspace is
+ * empty.
+ */
+static Client *mru_refill(int ws)
+{
+	Client *c;
+
+	for (c = wss[ws].head; c && wss[ws].mru_cnt < MRU_HISTORY; c = c->next)
+		if (!c->mru_next)
+			mru_add(ws, c);
+	return wss[ws].mru;
+}
+
+/**
+ * @brief Stop cycling through the focus history with focus_mru().
+ *
+ * The client that cycling stopped on is treated as having been focused, so
+ * that the next focus_mru() goes back to the client that cycling started on.
+ */
+static void end_mru_walk(void)
+{
+	if (!mru_walk)
+		return;
+	mru_touch(mru_walk->ws, mru_walk);
+	mru_walk = NULL;
+}
+
+/**
+ * @brief Find the client that was focused before the current one.
+ *
+ * @param ws The workspace whose focus history is used.
+ *
+ * @return The most recently focused client that isn't the current client, or
+ * NULL if there isn't one.
+ */
+static Client *prev_focus(int ws)
+{
+	Client *c = wss[ws].mru;
+
+	if (c && c == wss[ws].current)
+		c = c->mru_next;
+	return c == wss[ws].current ? NULL : c;
+}
+
+/**
+ * @brief Find the next client.
+ *
+ * Note: This function wraps around the end of the list of clients. If c is the
+ * last item in the list of clients, then the head of the list is returned.
+ *
+ * @param c The client which needs to have its next found.
+ *
+ * @return The next client, if c is the last client in the list then this will
+ * be head. If c is NULL or there is only one client in the client list, NULL
+ * will be returned.
+ */
+Client *next_client(Client *c)
+{
+	if (!c || !wss[cw].head	|| !wss[cw].head->next)
+		return NULL;
+	if (c->next)
+		return c->next;
+	return wss[cw].head;
+}
+
+/**
+ * @brief Arrange the current workspace.
+ */
+void arrange_windows(void)
+{
+	arrange_ws(cw);
+}
+
+/**
+ * @brief Call the appropriate layout handler for a workspace's layout.
+ *
+ * Only the output that ws is shown on is affected.
+ *
+ * @param ws The workspace to be arranged.
+ */
+static void arrange_ws(int ws)
+{
+	if (!wss[ws].head)
+		return;
+	if (txn.depth) {
+		wss[ws].arrange_pending = true;
+		return;
+	}
+	log_debug("Arranging windows of workspace <%d>", ws);
+	layout_handler[wss[ws].head->next ? wss[ws].layout : ZOOM](ws);
+	howm_info();
+}
+
+/**
+ * @brief Arrange the windows into a grid layout.
+ *
+ * @param ws The workspace to be arranged.
+ */
+void grid(int ws)
+{
+	unsigned int n = gather_tiles(ws), i;
+	unsigned int cols, rows, col_cnt = 0, row_cnt = 0;
+	xcb_rectangle_t r = ws_area(ws);
+	uint16_t col_w;
+	uint16_t col_h = r.height;
+
+	if (n <= 1) {
+		zoom(ws);
+		return;
+	}
+
+	log_info("Arranging %u clients in grid layout", n);
+	if (memo_restore(ws, GRID, n, r)) {
+		draw_tiles(ws, n);
+		return;
+	}
+
+	for (cols = 0; cols <= n / 2; cols++)
+		if (cols * cols >= n)
+			break;
+	rows = n / cols;
+	col_w = r.width / cols;
+	for (i = 0; i < n; i++) {
+		if (cols - (n % cols) < (i / rows) + 1)
+			rows = n / cols + 1;
+		tiles.x[i] = r.x + col_cnt * col_w;
+		tiles.y[i] = r.y + (row_cnt * col_h / rows);
+		tiles.w[i] = col_w;
+		tiles.h[i] = col_h / rows;
+		if (++row_cnt >= rows) {
+			row_cnt = 0;
+			col_cnt++;
+		}
+	}
+	memo_store(ws, GRID, n, r);
+	draw_tiles(ws, n);
+}
+
+/**
+ * @brief Have one window at a time taking up the entire screen.
+ *
+ * Sets the geometry of each window in order for the windows to be rendered to
+ * take up the entire screen.
+ *
+ * @param ws The workspace to be arranged.
+ */
+void zoom(int ws)
+{
+	unsigned int n = gather_tiles(ws), i;
+	xcb_rectangle_t r = ws_area(ws);
+
+	log_info("Arranging clients in zoom format");
+	/* When zoom is called because there aren't enough clients for other
 	 * layouts to work, draw a border to be consistent with other layouts.
 	 * */
-	if (wss[cw].layout != ZOOM && !wss[cw].head->is_fullscreen)
-		set_border_width(wss[cw].head->win, BORDER_PX);
-
-	for (c = wss[cw].head; c; c = c->next)
-		if (!FFT(c))
-			change_client_geom(c, 0, BAR_BOTTOM ? 0 : wss[cw].bar_height,
-					screen_width, screen_height - wss[cw].bar_height);
-	draw_clients();
+	if (wss[ws].layout != ZOOM && !wss[ws].head->is_fullscreen)
+		set_border_width(wss[ws].head->win, BORDER_PX);
+
+	if (!memo_restore(ws, ZOOM, n, r)) {
+		for (i = 0; i < n; i++) {
+			tiles.x[i] = r.x;
+			tiles.y[i] = r.y;
+			tiles.w[i] = r.width;
+			tiles.h[i] = r.height;
+		}
+		memo_store(ws, ZOOM, n, r);
+	}
+	draw_tiles(ws, n);
 }
 
 /**
@@ -911,11 +1970,12 @@ void zoom(void)
  * @param h The new height of the window.
  */
 void move_resize(xcb_window_t win,
-		 uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+		 int16_t x, int16_t y, uint16_t w, uint16_t h)
 {
-	uint32_t position[] = { x, y, w, h };
+	/* The server reads x and y back as INT16, so sign extend them. */
+	uint32_t position[] = { (uint32_t)(int32_t)x, (uint32_t)(int32_t)y, w, h };
 
-	xcb_configure_window(dpy, win, MOVE_RESIZE_MASK, position);
+	note_layout_seq(xcb_configure_window(dpy, win, MOVE_RESIZE_MASK, position));
 }
 
 /**
@@ -929,53 +1989,225 @@ void move_resize(xcb_window_t win,
  */
 void update_focused_client(Client *c)
 {
-	unsigned int all = 0, fullscreen = 0, float_trans = 0;
-
 	if (!c)
 		return;
 
 	if (!wss[cw].head) {
-		wss[cw].prev_foc = wss[cw].current = NULL;
+		wss[cw].current = NULL;
 		xcb_delete_property(dpy, screen->root, ewmh->_NET_ACTIVE_WINDOW);
 		return;
-	} else if (c == wss[cw].prev_foc) {
-		wss[cw].prev_foc = prev_client(wss[cw].current = wss[cw].prev_foc, cw);
-	} else if (c != wss[cw].current) {
-		wss[cw].prev_foc = wss[cw].current;
-		wss[cw].current = c;
 	}
+	wss[cw].current = c;
 
 	log_info("Focusing client <%p>", c);
-	for (c = wss[cw].head; c; c = c->next, ++all) {
-		if (FFT(c)) {
-			fullscreen++;
-			if (!c->is_fullscreen)
-				float_trans++;
-		}
+	restack_clients();
+	focus_current_client();
+	arrange_windows();
+}
+
+/**
+ * @brief Set the border of each client on the current workspace and stack
+ * them, so that fullscreen clients are at the top, followed by floating and
+ * transient clients and then the rest.
+ *
+ * The current client is placed at the top of its group.
+ */
+static void restack_clients(void)
+{
+	unsigned int i, n = part_len(cw);
+	Client *c, *prev = prev_focus(cw);
+
+	if (txn.depth) {
+		txn.restack = true;
+		return;
 	}
-	xcb_window_t windows[all];
+	if (!n)
+		return;
+	xcb_window_t windows[n];
 
-	windows[(wss[cw].current->is_floating || wss[cw].current->is_transient) ? 0 : float_trans] = wss[cw].current->win;
-	c = wss[cw].head;
-	for (fullscreen += FFT(wss[cw].current) ? 1 : 0; c; c = c->next) {
+	for (c = wss[cw].head; c; c = c->next) {
 		set_border_width(c->win, c->is_fullscreen ? 0 : BORDER_PX);
 		xcb_change_window_attributes(dpy, c->win, XCB_CW_BORDER_PIXEL,
 					     (c == wss[cw].current ? &border_focus :
-					      c == wss[cw].prev_foc ? &border_prev_focus
+					      c == prev ? &border_prev_focus
 					      : &border_unfocus));
-		if (c != wss[cw].current)
-			windows[c->is_fullscreen ? --fullscreen : FFT(c) ?
-				--float_trans : --all] = c->win;
 	}
 
-	for (float_trans = 0; float_trans <= all; ++float_trans)
-		elevate_window(windows[all - float_trans]);
+	n = stacking_order(cw, windows);
+	for (i = 0; i < n; i++)
+		elevate_window(windows[i]);
+	stacking_dirty = true;
+}
+
+/**
+ * @brief Work out the order that a workspace's clients should be stacked in.
+ *
+ * Tiled clients are at the bottom, followed by floating and transient
+ * clients, with fullscreen clients at the top. The current client is placed
+ * at the top of its group.
+ *
+ * @param ws The workspace whose clients should be ordered.
+ * @param wins Where the windows will be stored, from bottom to top. There
+ * must be space for part_len(ws) windows.
+ *
+ * @return The amount of windows stored in wins.
+ */
+static unsigned int stacking_order(int ws, xcb_window_t *wins)
+{
+	unsigned int n = 0, i = 0, end, group;
+	Client **part = ws_partition(ws), *cur = wss[ws].current;
+	bool seen;
+
+	for (group = 0; group < 3; group++) {
+		seen = false;
+		for (end = i + wss[ws].group_cnt[group]; i < end; i++) {
+			if (part[i] != cur)
+				wins[n++] = part[i]->win;
+			else
+				seen = true;
+		}
+		if (seen)
+			wins[n++] = cur->win;
+	}
+	return n;
+}
+
+/**
+ * @brief Find which group of the stacking order that a client belongs to.
+ *
+ * @param c The client.
+ *
+ * @return 0 for tiled clients, 1 for floating or transient clients and 2 for
+ * fullscreen clients.
+ */
+static unsigned int stacking_group(Client *c)
+{
+	if (c->is_fullscreen)
+		return 2;
+	return FFT(c) ? 1 : 0;
+}
+
+/**
+ * @brief Update a workspace's group counts after a client's floating,
+ * transient or fullscreen state has changed.
+ *
+ * @param c The client whose state has changed.
+ * @param old The stacking group that c was in before the change.
+ */
+static void regroup_client(Client *c, unsigned int old)
+{
+	unsigned int group = stacking_group(c);
+
+	if (!c->ws || group == old)
+		return;
+	wss[c->ws].group_cnt[old]--;
+	wss[c->ws].group_cnt[group]++;
+	wss[c->ws].part_dirty = true;
+}
+
+/**
+ * @brief Get the clients of a workspace, partitioned by stacking group.
+ *
+ * The tiled clients come first, followed by the floating and then the
+ * fullscreen clients. The sizes of the partitions are given by group_cnt.
+ * The array is only rebuilt when the client list has changed since it was
+ * last asked for.
+ *
+ * The array is sized from group_cnt alone. Every change to a client's group
+ * goes through attach_client(), detach_client() or regroup_client(), so the
+ * counts must match the client list. If they don't, no partition is written
+ * past its end and howm gives up rather than use a broken array.
+ *
+ * @param ws The workspace.
+ *
+ * @return The partitioned clients, which are owned by the workspace. It holds
+ * part_len(ws) clients.
+ */
+static Client **ws_partition(int ws)
+{
+	Workspace *w = &wss[ws];
+	unsigned int off[3], end[3], g, len = part_len(ws), cap = w->part_cap;
+	Client *c;
+
+	if (!w->part_dirty)
+		return w->part;
+	if (len > cap) {
+		while (cap < len)
+			cap = cap ? cap * 2 : 16;
+		w->part = realloc(w->part, cap * sizeof(Client *));
+		if (!w->part) {
+			log_err("Can't allocate memory for the partitions of workspace <%d>.", ws);
+			exit(EXIT_FAILURE);
+		}
+		w->part_cap = cap;
+	}
+	off[0] = 0;
+	off[1] = end[0] = w->group_cnt[0];
+	off[2] = end[1] = off[1] + w->group_cnt[1];
+	end[2] = len;
+	for (c = w->head; c; c = c->next) {
+		g = stacking_group(c);
+		if (off[g] == end[g])
+			break;
+		w->part[off[g]++] = c;
+	}
+	if (c || off[0] != end[0] || off[1] != end[1] || off[2] != end[2]) {
+		log_err("Group counts of workspace <%d> don't match its client list.", ws);
+		exit(EXIT_FAILURE);
+	}
+	w->part_dirty = false;
+	return w->part;
+}
+
+/**
+ * @brief Find how many clients a workspace's partitions hold.
+ *
+ * @param ws The workspace.
+ *
+ * @return The sum of the workspace's group counts.
+ */
+static unsigned int part_len(int ws)
+{
+	return wss[ws].group_cnt[0] + wss[ws].group_cnt[1] + wss[ws].group_cnt[2];
+}
+
+/**
+ * @brief Give input focus to the current client and let EWMH compliant
+ * programs know that it is the active window.
+ *
+ * The client is moved to the front of the workspace's focus history, unless
+ * focus_mru() is cycling through it. The history is always updated straight
+ * away, but within a transaction the X requests wait for it to be committed.
+ */
+static void focus_current_client(void)
+{
+	if (wss[cw].current != mru_walk) {
+		end_mru_walk();
+		mru_touch(cw, wss[cw].current);
+	}
+	if (txn.depth) {
+		txn.focus = true;
+		return;
+	}
+	send_focus();
+}
 
+/**
+ * @brief Send the X requests that give input focus to the current client,
+ * or to the root window if the current workspace is empty.
+ */
+static void send_focus(void)
+{
+	if (!wss[cw].current) {
+		xcb_delete_property(dpy, screen->root, ewmh->_NET_ACTIVE_WINDOW);
+		xcb_set_input_focus(dpy, XCB_INPUT_FOCUS_POINTER_ROOT, screen->root,
+				XCB_CURRENT_TIME);
+		return;
+	}
 	xcb_ewmh_set_active_window(ewmh, 0, wss[cw].current->win);
 
 	xcb_set_input_focus(dpy, XCB_INPUT_FOCUS_POINTER_ROOT, wss[cw].current->win,
 			    XCB_CURRENT_TIME);
-	arrange_windows();
 }
 
 /**
@@ -1061,7 +2293,7 @@ void set_border_width(xcb_window_t win, uint16_t w)
 {
 	uint32_t width[1] = { w };
 
-	xcb_configure_window(dpy, win, XCB_CONFIG_WINDOW_BORDER_WIDTH, width);
+	note_layout_seq(xcb_configure_window(dpy, win, XCB_CONFIG_WINDOW_BORDER_WIDTH, width));
 }
 
 /**
@@ -1072,57 +2304,226 @@ void set_border_width(xcb_window_t win, uint16_t w)
 void elevate_window(xcb_window_t win)
 {
 	uint32_t stack_mode[1] = { XCB_STACK_MODE_ABOVE };
+	Client *c = find_client_by_win(win);
 
-	if (!find_client_by_win(win))
+	if (!c)
 		return;
-	log_info("Moving window client <%p> to the front", find_client_by_win(win));
-	xcb_configure_window(dpy, win, XCB_CONFIG_WINDOW_STACK_MODE, stack_mode);
+	log_info("Moving window client <%p> to the front", c);
+	note_layout_seq(xcb_configure_window(dpy, win, XCB_CONFIG_WINDOW_STACK_MODE, stack_mode));
 }
 
 /**
- * @brief Request all of the atoms that howm supports.
+ * @brief Remember the sequence number of a request that may move a window
+ * under the pointer.
  *
- * @param names The names of the atoms to be fetched.
- * @param atoms Where the returned atoms will be stored.
+ * All such requests that are sent whilst handling one event are grouped into
+ * a single range, which is closed by end_layout_seq().
+ *
+ * @param cookie The cookie returned when sending the request.
  */
-void get_atoms(char **names, xcb_atom_t *atoms)
+static void note_layout_seq(xcb_void_cookie_t cookie)
+{
+	if (layout_seq_open)
+		return;
+	layout_seq_idx = (layout_seq_idx + 1) % LAYOUT_SEQ_RANGES;
+	layout_seqs[layout_seq_idx].first = cookie.sequence;
+	layout_seqs[layout_seq_idx].end = cookie.sequence;
+	layout_seq_open = true;
+}
+
+/**
+ * @brief Close the current range of layout requests, so that the next
+ * request starts a new one.
+ *
+ * An EnterNotify carries the sequence number of the last request that the
+ * server had processed, so one that comes from real pointer motion straight
+ * after a layout has the same sequence as the layout's last request. A cheap
+ * marker request is sent to end the range, and only events from before the
+ * marker are treated as caused by the layout.
+ */
+static void end_layout_seq(void)
+{
+	xcb_get_input_focus_cookie_t marker;
+
+	if (!layout_seq_open)
+		return;
+	marker = xcb_get_input_focus(dpy);
+	xcb_discard_reply(dpy, marker.sequence);
+	layout_seqs[layout_seq_idx].end = marker.sequence;
+	layout_seq_open = false;
+}
+
+/**
+ * @brief Check whether an event was generated by one of howm's own layout or
+ * stacking requests.
+ *
+ * @param seq The sequence number of the event.
+ *
+ * @return True if seq is at or after the start of a remembered range and
+ * strictly before its marker. Unused ranges are empty, so never match.
+ */
+static bool caused_by_layout(uint16_t seq)
 {
-	xcb_intern_atom_reply_t *reply;
 	unsigned int i;
-	xcb_intern_atom_cookie_t cookies[LENGTH(names)];
+	struct seq_range *r;
 
-	for (i = 0; i <= LENGTH(names); i++) {
-		cookies[i] = xcb_intern_atom(dpy, 0, strlen(names[i]), names[i]);
-		log_debug("Requesting atom %s", names[i]);
-	}
-	for (i = 0; i <= LENGTH(names); i++) {
-		reply = xcb_intern_atom_reply(dpy, cookies[i], NULL);
-		if (reply) {
-			atoms[i] = reply->atom;
-			log_debug("Got reply for atom %s", names[i]);
-			free(reply);
-		} else {
-			log_warn("The atom %s has not been registered by howm.", names[i]);
-		}
+	for (i = 0; i < LAYOUT_SEQ_RANGES; i++) {
+		r = &layout_seqs[i];
+		if ((uint16_t)(seq - r->first) < (uint16_t)(r->end - r->first))
+			return true;
 	}
+	return false;
 }
 
 /**
- * @brief Arrange the windows in a stack, whether that be horizontal or
- * vertical is decided by the current_layout.
+ * @brief Take a client's window off of the screen.
+ *
+ * When PARK_WORKSPACES is true the window stays mapped and is moved
+ * off-screen, so that it doesn't need to be repainted when it is shown again.
+ * Otherwise the window is unmapped.
+ *
+ * Within a transaction nothing is sent, every client is put where it belongs
+ * when the transaction is committed.
+ *
+ * @param c The client to be hidden.
  */
-void stack(void)
+static void hide_client(Client *c)
 {
-	Client *c = get_first_non_tff();
-	bool vert = (wss[cw].layout == VSTACK);
-	uint16_t h = screen_height - wss[cw].bar_height;
-	uint16_t w = screen_width;
-	int n = get_non_tff_count();
-	uint16_t client_x = 0, client_span = 0;
-	uint16_t client_y = BAR_BOTTOM ? 0 : wss[cw].bar_height;
-	uint16_t ms = (vert ? w : h) * wss[cw].master_ratio;
-	/* The size of the direction the clients will be stacked in. e.g.
-	 *
+	if (txn.depth) {
+		txn.show = true;
+		return;
+	}
+	if (!PARK_WORKSPACES) {
+		unmap_client(c);
+		return;
+	}
+	park_client(c);
+}
+
+/**
+ * @brief Move a client's window off-screen, leaving it mapped.
+ *
+ * The client's x is left alone, so that the window can be put back where it
+ * was. Where the window really is is kept in park_x.
+ *
+ * @param c The client to be parked.
+ */
+static void park_client(Client *c)
+{
+	int32_t px = -2 * (int32_t)screen_width;
+	uint32_t x[1];
+
+	if (c->is_parked)
+		return;
+	/* Window coordinates are 16 bits on the wire. */
+	c->park_x = px < INT16_MIN ? INT16_MIN : px;
+	x[0] = (uint32_t)(int32_t)c->park_x;
+	c->is_parked = true;
+	note_layout_seq(xcb_configure_window(dpy, c->win, XCB_CONFIG_WINDOW_X, x));
+	ewmh_set_wm_state(c);
+}
+
+/**
+ * @brief Unmap a client's window and remember that howm caused it.
+ *
+ * The UnmapNotify that the X server sends back is then known to be
+ * self-inflicted and doesn't cause the client to be removed. A window that
+ * isn't mapped is left alone, as no UnmapNotify would come back for it.
+ *
+ * @param c The client whose window should be unmapped.
+ */
+static void unmap_client(Client *c)
+{
+	if (!c->is_mapped)
+		return;
+	c->is_mapped = false;
+	c->unmaps_expected++;
+	note_layout_seq(xcb_unmap_window(dpy, c->win));
+}
+
+/**
+ * @brief Map a client's window.
+ *
+ * @param c The client whose window should be mapped.
+ */
+static void map_client(Client *c)
+{
+	if (c->is_mapped)
+		return;
+	c->is_mapped = true;
+	note_layout_seq(xcb_map_window(dpy, c->win));
+}
+
+/**
+ * @brief Put a client's window back on the screen.
+ *
+ * A parked window is moved back into place by the next call to
+ * draw_clients(), so only its _NET_WM_STATE needs updating here. As with
+ * hide_client(), nothing is sent within a transaction.
+ *
+ * @param c The client to be shown.
+ */
+static void show_client(Client *c)
+{
+	if (txn.depth) {
+		txn.show = true;
+		return;
+	}
+	if (!PARK_WORKSPACES) {
+		map_client(c);
+		return;
+	}
+	if (!c->is_parked)
+		return;
+	c->is_parked = false;
+	ewmh_set_wm_state(c);
+}
+
+/**
+ * @brief Request all of the atoms that howm supports.
+ *
+ * @param names The names of the atoms to be fetched.
+ * @param atoms Where the returned atoms will be stored.
+ */
+void get_atoms(char **names, xcb_atom_t *atoms, unsigned int cnt)
+{
+	xcb_intern_atom_reply_t *reply;
+	unsigned int i;
+	xcb_intern_atom_cookie_t cookies[cnt];
+
+	for (i = 0; i < cnt; i++) {
+		cookies[i] = xcb_intern_atom(dpy, 0, strlen(names[i]), names[i]);
+		log_debug("Requesting atom %s", names[i]);
+	}
+	for (i = 0; i < cnt; i++) {
+		reply = xcb_intern_atom_reply(dpy, cookies[i], NULL);
+		if (reply) {
+			atoms[i] = reply->atom;
+			log_debug("Got reply for atom %s", names[i]);
+			free(reply);
+		} else {
+			log_warn("The atom %s has not been registered by howm.", names[i]);
+		}
+	}
+}
+
+/**
+ * @brief Arrange the windows in a stack, whether that be horizontal or
+ * vertical is decided by the current_layout.
+ *
+ * @param ws The workspace to be arranged.
+ */
+void stack(int ws)
+{
+	unsigned int n = gather_tiles(ws), i;
+	bool vert = (wss[ws].layout == VSTACK);
+	xcb_rectangle_t r = ws_area(ws);
+	uint16_t h = r.height;
+	uint16_t w = r.width;
+	uint16_t client_span = 0;
+	uint16_t ms = (vert ? w : h) * wss[ws].master_ratio;
+	/* The size of the direction the clients will be stacked in. e.g.
+	 *
 	 *+---------------------------+--------------+   +
 	 *|                           |              |   |
 	 *|                           |              |   |
@@ -1144,69 +2545,77 @@ void stack(void)
 	uint16_t span = vert ? h : w;
 
 	if (n <= 1) {
-		zoom();
+		zoom(ws);
+		return;
+	}
+
+	log_info("Arranging %u clients in %sstack layout", n, vert ? "v" : "h");
+	if (memo_restore(ws, wss[ws].layout, n, r)) {
+		draw_tiles(ws, n);
 		return;
 	}
 
 	/* TODO: Need to take into account when this has remainders. */
 	client_span = (span / (n - 1));
 
-	log_info("Arranging %d clients in %sstack layout", n, vert ? "v" : "h");
+	tiles.x[0] = r.x;
+	tiles.y[0] = r.y;
+	tiles.w[0] = vert ? ms : span;
+	tiles.h[0] = vert ? span : ms;
+
 	if (vert) {
-		change_client_geom(c, 0, client_y,
-			    ms, span);
+		for (i = 1; i < n; i++) {
+			tiles.x[i] = r.x + ms;
+			tiles.y[i] = r.y + (i - 1) * client_span;
+			tiles.w[i] = w - ms;
+			tiles.h[i] = client_span;
+		}
 	} else {
-		change_client_geom(c, 0, BAR_BOTTOM ? 0 : wss[cw].bar_height,
-			span, ms);
-	}
-
-	for (c = c->next; c; c = c->next) {
-		if (FFT(c))
-			continue;
-		if (vert) {
-			change_client_geom(c, ms, client_y,
-				    screen_width - ms,
-				    client_span);
-			client_y += client_span;
-		} else {
-			change_client_geom(c, client_x, ms,
-				    client_span,
-				    screen_height - wss[cw].bar_height - ms);
-			client_x += client_span;
+		for (i = 1; i < n; i++) {
+			tiles.x[i] = r.x + (i - 1) * client_span;
+			tiles.y[i] = r.y + ms;
+			tiles.w[i] = client_span;
+			tiles.h[i] = h - ms;
 		}
 	}
-	draw_clients();
+	memo_store(ws, wss[ws].layout, n, r);
+	draw_tiles(ws, n);
 }
 
 /**
- * @brief Count how many clients aren't Transient, Floating or Fullscreen.
+ * @brief Point the tile arrays at the tiled clients of a workspace (those
+ * that aren't transient, floating or fullscreen) and collect their gaps.
  *
- * @return The amount of clients in the current workspace that aren't TFF.
- */
-int get_non_tff_count(void)
-{
-	int n = 0;
-	Client *c = NULL;
-
-	for (c = wss[cw].head; c; c = c->next)
-		if (!FFT(c))
-			n++;
-	return n;
-}
-
-/**
- * @brief Returns the first client that isn't transient, floating or
- * fullscreen.
+ * The arrays are grown if they are too small for the workspace.
  *
- * @return The first client that isn't TFF. NULL if none.
+ * @param ws The workspace whose clients should be collected.
+ *
+ * @return The amount of tiled clients.
  */
-static Client *get_first_non_tff(void)
+static unsigned int gather_tiles(int ws)
 {
-	Client *c = NULL;
-
-	for (c = wss[cw].head; c && FFT(c); c = c->next)
-		;
-	return c;
+	unsigned int n, cap = tiles.cap, i;
+
+	tiles.c = ws_partition(ws);
+	tiles.len = part_len(ws);
+	n = wss[ws].group_cnt[0];
+	if (n > cap) {
+		while (cap < n)
+			cap = cap ? cap * 2 : 16;
+		tiles.x = realloc(tiles.x, cap * sizeof(int16_t));
+		tiles.y = realloc(tiles.y, cap * sizeof(int16_t));
+		tiles.w = realloc(tiles.w, cap * sizeof(uint16_t));
+		tiles.h = realloc(tiles.h, cap * sizeof(uint16_t));
+		tiles.g = realloc(tiles.g, cap * sizeof(uint16_t));
+		if (!tiles.x || !tiles.y || !tiles.w || !tiles.h || !tiles.g) {
+			log_err("Can't allocate memory for tiles.");
+			exit(EXIT_FAILURE);
+		}
+		tiles.cap = cap;
+	}
+	for (i = 0; i < n; i++)
+		tiles.g[i] = tiles.c[i]->gap;
+	return n;
 }
 
 /**
@@ -1222,12 +2631,25 @@ void destroy_event(xcb_generic_event_t *ev)
 {
 	xcb_destroy_notify_event_t *de = (xcb_destroy_notify_event_t *)ev;
 	Client *c = find_client_by_win(de->window);
+	struct segment *seg;
+	Client **s;
+	int ws;
 
-	if (!c)
+	if (!c) {
+		s = stowed_slot(de->window);
+		if (s)
+			drop_stowed(s);
+		else if ((seg = reg_find(&del_reg, de->window, &c)))
+			reg_forget(&del_reg, seg, c);
 		return;
+	}
 	log_info("Client <%p> wants to be destroyed", c);
+	ws = client_ws(c);
 	remove_client(c);
-	arrange_windows();
+	if (ws_visible(ws))
+		arrange_ws(ws);
+	else
+		wss[ws].dirty = true;
 }
 
 /**
@@ -1237,25 +2659,27 @@ void destroy_event(xcb_generic_event_t *ev)
  */
 void remove_client(Client *c)
 {
-	Client **temp = NULL;
-	int w = 1;
+	int w = client_ws(c);
 
-	for (; w <= WORKSPACES; w++)
-		for (temp = &wss[w].head; *temp; temp = &(*temp)->next)
-			if (*temp == c)
-				goto found;
-	return;
-
-found:
-	*temp = c->next;
+	if (!w)
+		return;
+	detach_client(w, c);
+	mru_del(w, c);
+	win_index_del(&clients_by_win, c->win);
+	if (c->is_urgent)
+		urgent_unlink(c);
+	forget_scratchpad(c);
 	log_info("Removing client <%p>", c);
-	if (c == wss[w].prev_foc)
-		wss[w].prev_foc = prev_client(wss[w].current, w);
-	if (c == wss[w].current || !wss[w].head->next)
-		wss[w].current = wss[w].prev_foc ? wss[w].prev_foc : wss[w].head;
-	free(c);
+	if (c == drag.c) {
+		drag.c = NULL;
+		xcb_ungrab_pointer(dpy, XCB_CURRENT_TIME);
+	}
+	if (c == wss[w].current)
+		wss[w].current = mru_refill(w);
+	client_release(&clients, c);
 	c = NULL;
 	wss[w].client_cnt--;
+	client_list_dirty = stacking_dirty = true;
 }
 
 /**
@@ -1267,16 +2691,23 @@ found:
 void howm_info(void)
 {
 	unsigned int w = 0;
+
+	if (txn.depth) {
+		txn.info = true;
+		return;
+	}
 #if DEBUG_ENABLE
-	for (w = 1; w <= WORKSPACES; w++) {
-		fprintf(stdout, "%u:%d:%u:%u:%u\n", cur_mode,
-		       wss[w].layout, w, cur_state, wss[w].client_cnt);
+	for (w = 1; w <= (unsigned int)ws_cnt; w++) {
+		fprintf(stdout, "%u:%d:%u:%u:%u:%u\n", cur_mode,
+		       wss[w].layout, w, cur_state, wss[w].client_cnt,
+		       wss[w].urgent_cnt);
 	}
 	fflush(stdout);
 #else
 	UNUSED(w);
-	fprintf(stdout, "%u:%d:%u:%u:%u\n", cur_mode,
-		wss[cw].layout, cw, cur_state, wss[cw].client_cnt);
+	fprintf(stdout, "%u:%d:%u:%u:%u:%u\n", cur_mode,
+		wss[cw].layout, cw, cur_state, wss[cw].client_cnt,
+		wss[cw].urgent_cnt);
 	fflush(stdout);
 #endif
 }
@@ -1284,6 +2715,9 @@ void howm_info(void)
 /**
  * @brief The event that occurs when the mouse pointer enters a window.
  *
+ * EnterNotify events that were caused by howm moving or restacking windows
+ * are dropped, so that only real pointer motion changes focus.
+ *
  * @param ev The enter event.
  */
 void enter_event(xcb_generic_event_t *ev)
@@ -1291,6 +2725,14 @@ void enter_event(xcb_generic_event_t *ev)
 	xcb_enter_notify_event_t *ee = (xcb_enter_notify_event_t *)ev;
 
 	log_debug("Enter event for window <%d>", ee->event);
+	/* Only focus when the pointer has really moved into the window, not when
+	 * a window was moved under it or a grab ended. */
+	if (ee->mode != XCB_NOTIFY_MODE_NORMAL
+			|| ee->detail == XCB_NOTIFY_DETAIL_INFERIOR
+			|| caused_by_layout(ee->sequence)) {
+		log_debug("Ignoring enter event for window <%d>", ee->event);
+		return;
+	}
 	if (FOCUS_MOUSE && wss[cw].layout != ZOOM)
 		focus_window(ee->event);
 }
@@ -1298,26 +2740,19 @@ void enter_event(xcb_generic_event_t *ev)
 /**
  * @brief Move a client down in its client list.
  *
+ * The last client wraps around to become the head.
+ *
  * @param c The client to be moved.
  */
 void move_down(Client *c)
 {
-	Client *prev = prev_client(c, cw);
-	Client *n = (c->next) ? c->next : wss[cw].head;
+	Client *n;
 
-	if (!c)
-		return;
-	if (!prev)
+	if (!c || !prev_client(c, cw))
 		return;
-	if (wss[cw].head == c)
-		wss[cw].head = n;
-	else
-		prev->next = c->next;
-	c->next = (c->next) ? n->next : n;
-	if (n->next == c->next)
-		n->next = c;
-	else
-		wss[cw].head = c;
+	n = c->next;
+	detach_client(cw, c);
+	attach_client(cw, n, c);
 	log_info("Moved client <%p> on workspace <%d> down", c, cw);
 	arrange_windows();
 }
@@ -1325,27 +2760,20 @@ void move_down(Client *c)
 /**
  * @brief Move a client up in its client list.
  *
- * @param c The client to be moved down.
+ * The head wraps around to become the last client.
+ *
+ * @param c The client to be moved up.
  */
 void move_up(Client *c)
 {
-	Client *p = prev_client(c, cw);
-	Client *pp = NULL;
+	Client *after;
 
-	if (!c)
+	if (!c || !prev_client(c, cw))
 		return;
-	if (!p)
-		return;
-	if (p->next)
-		for (pp = wss[cw].head; pp && pp->next != p; pp = pp->next)
-			;
-	if (pp)
-		pp->next = c;
-	else
-		wss[cw].head = (wss[cw].head == c) ? c->next : c;
-	p->next = (c->next == wss[cw].head) ? c : c->next;
-	c->next = (c->next == wss[cw].head) ? NULL : p;
-	log_info("Moved client <%p> on workspace <%d> down", c, cw);
+	after = c == wss[cw].head ? wss[cw].tail : c->prev->prev;
+	detach_client(cw, c);
+	attach_client(cw, after, c);
+	log_info("Moved client <%p> on workspace <%d> up", c, cw);
 	arrange_windows();
 }
 
@@ -1376,34 +2804,98 @@ void focus_prev_client(const Arg *arg)
 	if (!wss[cw].current || !wss[cw].head->next)
 		return;
 	log_info("Focusing previous client");
-	wss[cw].prev_foc = wss[cw].current;
-	update_focused_client(prev_client(wss[cw].prev_foc, cw));
+	update_focused_client(prev_client(wss[cw].current, cw));
+}
+
+/**
+ * @brief Move focus back through the focus history of the current
+ * workspace.
+ *
+ * The first press focuses the client that was used before the current one.
+ * Pressing again, without pressing another key in between, goes further back
+ * in the history rather than returning to where it started.
+ *
+ * @param arg Unused.
+ */
+static void focus_mru(const Arg *arg)
+{
+	UNUSED(arg);
+	Client *c = wss[cw].current;
+
+	if (!c || !wss[cw].head->next)
+		return;
+	mru_walk = (mru_walk == c ? c : wss[cw].mru)->mru_next;
+	log_info("Focusing client <%p> from the focus history", mru_walk);
+	update_focused_client(mru_walk);
 }
 
 /**
  * @brief Change to a different workspace and map the correct windows.
  *
+ * If the workspace is already shown on another output, that output is
+ * focused instead and nothing needs to be mapped.
+ *
+ * Otherwise, the new workspace replaces the old one on the focused output.
+ * Within a transaction only howm's own state is changed, and the windows are
+ * shown and hidden by txn_commit().
+ * It is arranged and stacked before any of its windows are mapped, so that
+ * each window appears with its final geometry. The old workspace's windows
+ * are hidden first, so that the two workspaces are never on screen at once,
+ * and the new workspace's windows are then mapped together.
+ *
  * @param arg arg->i indicates which workspace howm should change to.
  */
 void change_ws(const Arg *arg)
 {
-	Client *c = wss[arg->i].head;
+	Monitor *m;
+	Client *c;
 
-	if (arg->i > WORKSPACES || arg->i <= 0 || arg->i == cw)
+	if (arg->i > ws_cnt || arg->i <= 0 || arg->i == cw)
 		return;
 	last_ws = cw;
 	log_info("Changing from workspace <%d> to <%d>.", last_ws, arg->i);
-	for (; c; c = c->next)
-		xcb_map_window(dpy, c->win);
-	for (c = wss[last_ws].head; c; c = c->next)
-		xcb_unmap_window(dpy, c->win);
+	m = ws_mon(arg->i);
+	if (m) {
+		if (wss[last_ws].current)
+			xcb_change_window_attributes(dpy, wss[last_ws].current->win,
+					XCB_CW_BORDER_PIXEL, &border_unfocus);
+		cur_mon = m - mons;
+		cw = arg->i;
+		if (wss[cw].current) {
+			restack_clients();
+			focus_current_client();
+		} else if (!txn.depth) {
+			xcb_set_input_focus(dpy, XCB_INPUT_FOCUS_POINTER_ROOT,
+					screen->root, XCB_CURRENT_TIME);
+		}
+		if (!txn.depth)
+			xcb_ewmh_set_current_desktop(ewmh, 0, cw - 1);
+		howm_info();
+		return;
+	}
 	cw = arg->i;
-	update_focused_client(wss[cw].current);
+	mons[cur_mon].ws = cw;
+	if (txn.depth) {
+		/* The windows are swapped over when the transaction is
+		 * committed, so a workspace passed through isn't drawn. */
+		txn.show = true;
+		arrange_ws(cw);
+		return;
+	}
+	apply_pending(cw);
+	if (wss[cw].current) {
+		restack_clients();
+		arrange_windows();
+	}
+	for (c = wss[last_ws].head; c; c = c->next)
+		hide_client(c);
+	for (c = wss[cw].head; c; c = c->next)
+		show_client(c);
+	if (wss[cw].current)
+		focus_current_client();
 
 	xcb_ewmh_set_current_desktop(ewmh, 0, cw - 1);
-	xcb_ewmh_geometry_t workarea[] = { { 0, BAR_BOTTOM ? 0 : wss[cw].bar_height,
-				screen_width, screen_height - wss[cw].bar_height } };
-	xcb_ewmh_set_workarea(ewmh, 0, LENGTH(workarea), workarea);
+	update_workarea();
 
 	howm_info();
 }
@@ -1554,27 +3046,10 @@ void op_kill(const unsigned int type, int cnt)
  */
 void kill_client(const int ws, bool arrange)
 {
-	xcb_icccm_get_wm_protocols_reply_t rep;
-	unsigned int i;
-	bool found = false;
-
 	if (!wss[ws].current)
 		return;
 
-	if (xcb_icccm_get_wm_protocols_reply(dpy,
-				xcb_icccm_get_wm_protocols(dpy,
-					wss[ws].current->win,
-					wm_atoms[WM_PROTOCOLS]), &rep, NULL)) {
-		for (i = 0; i < rep.atoms_len; ++i)
-			if (rep.atoms[i] == wm_atoms[WM_DELETE_WINDOW]) {
-				delete_win(wss[ws].current->win);
-				found = true;
-				break;
-			}
-		xcb_icccm_get_wm_protocols_reply_wipe(&rep);
-	}
-	if (!found)
-		xcb_kill_client(dpy, wss[ws].current->win);
+	close_win(wss[ws].current->win);
 	log_info("Killing Client <%p>", wss[ws].current);
 	remove_client(wss[ws].current);
 	if (arrange)
@@ -1628,31 +3103,87 @@ void op_move_up(const unsigned int type, int cnt)
  * Moves a single client or multiple clients either up or
  * down. The op_move_* functions serves as simple wrappers to this.
  *
+ * Moving a group of clients up by one place is the same as moving the client
+ * before the group down past all of them (and the inverse for moving down).
+ * That client is spliced straight into its final place, which is the same
+ * place that moving it one step at a time (wrapping around the ends of the
+ * list) would leave it in.
+ *
  * @param cnt How many clients to move.
  * @param up Whether to move the clients up or down. True is up.
  */
 void move_client(int cnt, bool up)
 {
-	int cntcopy;
+	int n = wss[cw].client_cnt, cur, p, f;
 	Client *c;
 
+	if (!wss[cw].current || n < 2 || cnt <= 0)
+		return;
+	if (up && wss[cw].current == wss[cw].head)
+		return;
+	if (!up && wss[cw].current == wss[cw].tail)
+		return;
+
+	for (cur = 0, c = wss[cw].head; c != wss[cw].current; c = c->next)
+		cur++;
 	if (up) {
-		if (wss[cw].current == wss[cw].head)
-			return;
-		c = prev_client(wss[cw].current, cw);
-		/* TODO optimise this by inserting the client only once
-			* and in the correct location.*/
-		for (; cnt > 0; move_down(c), cnt--)
-			;
+		p = cur - 1;
+		f = (p + cnt) % n;
 	} else {
-		if (wss[cw].current == prev_client(wss[cw].head, cw))
-			return;
-		cntcopy = cnt;
-		for (c = wss[cw].current; cntcopy > 0; c = next_client(c), cntcopy--)
+		p = (cur + cnt) % n;
+		f = ((p - cnt) % n + n) % n;
+	}
+	c = client_at(cw, p);
+	place_client(cw, c, p, f);
+	log_info("Moved client <%p> on workspace <%d> from %d to %d", c, cw, p, f);
+	arrange_windows();
+}
+
+/**
+ * @brief Find the client at a position in a workspace's client list.
+ *
+ * The list is walked from whichever end is closer.
+ *
+ * @param ws The workspace.
+ * @param pos The position, which must be less than the amount of clients.
+ *
+ * @return The client at pos.
+ */
+static Client *client_at(int ws, int pos)
+{
+	int n = wss[ws].client_cnt;
+	Client *c;
+
+	if (pos <= n / 2)
+		for (c = wss[ws].head; pos-- > 0; c = c->next)
 			;
-		for (; cnt > 0; move_up(c), cnt--)
+	else
+		for (c = wss[ws].tail; ++pos < n; c = c->prev)
 			;
-	}
+	return c;
+}
+
+/**
+ * @brief Move a client to a new position in its workspace's client list, with
+ * a single unlink and relink.
+ *
+ * @param ws The workspace that c is on.
+ * @param c The client to be moved.
+ * @param p The current position of c.
+ * @param f The position that c should end up in.
+ */
+static void place_client(int ws, Client *c, int p, int f)
+{
+	Client *after = NULL;
+
+	if (p == f)
+		return;
+	/* The client that c will follow, found before c is taken out. Clients
+	 * after c move back one place once it is taken out. */
+	if (f > 0)
+		after = client_at(ws, f - 1 < p ? f - 1 : f);
+	detach_client(ws, c);
+	attach_client(ws, after, c);
 }
 
 /**
@@ -1680,38 +3211,44 @@ void move_current_up(const Arg *arg)
 /**
  * @brief Moves a client from one workspace to another.
  *
+ * When the target workspace is shown on another output, the client is moved
+ * across to that output rather than being hidden.
+ *
  * @param c The client to be moved.
  * @param ws The ws that the client should be moved to.
  */
 void client_to_ws(Client *c, const int ws, bool follow)
 {
-	Client *last;
-	Client *prev = prev_client(c, cw);
+	Monitor *from = ws_output(cw), *to = ws_output(ws);
+	Client *prev;
 
 	/* Performed for the current workspace. */
 	if (!c || ws == cw)
 		return;
+	/* Current workspace. */
+	detach_client(cw, c);
+	mru_del(cw, c);
+	prev = wss[cw].current = mru_refill(cw);
+	wss[cw].client_cnt--;
+
 	/* Target workspace. */
-	last = prev_client(wss[ws].head, ws);
-	if (!wss[ws].head)
-		wss[ws].head = c;
-	else if (last)
-		last->next = c;
-	else
-		wss[ws].head->next = c;
+	attach_client(ws, wss[ws].tail, c);
 	wss[ws].current = c;
+	mru_touch(ws, c);
 	wss[ws].client_cnt++;
 
-	/* Current workspace. */
-	if (c == wss[cw].head || !prev)
-		wss[cw].head = c->next;
+	c->ws = ws;
+	if (c->is_fullscreen) {
+		change_client_geom(c, to->x, to->y, to->w, to->h);
+	} else if (c->is_floating) {
+		c->x += to->x - from->x;
+		c->y += to->y - from->y;
+	}
+	if (ws_visible(ws))
+		arrange_ws(ws);
 	else
-		prev->next = c->next;
-	wss[cw].current = prev;
-	wss[cw].client_cnt--;
-
-	c->next = NULL;
-	xcb_unmap_window(dpy, c->win);
+		hide_client(c);
+	stacking_dirty = true;
 
 	log_info("Moved client <%p> from <%d> to <%d>", c, cw, ws);
 	if (follow) {
@@ -1736,8 +3273,8 @@ void current_to_ws(const Arg *arg)
 /**
  * @brief Correctly wrap a workspace number.
  *
- * This prevents workspace numbers from being greater than WORKSPACES or less
- * than 1.
+ * This prevents workspace numbers from being greater than the amount of
+ * workspaces or less than 1, however far out of range they are.
  *
  * @param ws The value that needs to be corrected.
  *
@@ -1745,90 +3282,432 @@ void current_to_ws(const Arg *arg)
  */
 int correct_ws(int ws)
 {
-	if (ws > WORKSPACES)
-		return ws - WORKSPACES;
-	if (ws < 1)
-		return ws + WORKSPACES;
-
-	return ws;
+	return ((ws - 1) % ws_cnt + ws_cnt) % ws_cnt + 1;
 }
 
 /**
- * @brief Focus the given window, so long as it isn't already focused.
+ * @brief Change how many workspaces there is room for.
  *
- * @param win A window that belongs to a client being managed by howm.
+ * New workspaces take their settings from ws_defaults, and those past its end
+ * use its last entry. Nothing else is allocated for a workspace until a client
+ * is placed on it.
+ *
+ * @param n The new amount of workspaces.
  */
-void focus_window(xcb_window_t win)
+static void resize_wss(int n)
 {
-	Client *c = find_client_by_win(win);
+	Workspace *nw = realloc(wss, sizeof(Workspace) * (n + 1));
+	int *nb = realloc(busy_ws, sizeof(int) * n);
+	const Workspace *d;
+	int w;
 
-	if (c && !(c == wss[cw].current))
-		update_focused_client(c);
-	else
-		/* We don't want warnings for clicking the root window... */
-		if (!win == screen->root)
-			log_warn("No client owns the window <%d>", win);
+	if (nw)
+		wss = nw;
+	if (nb)
+		busy_ws = nb;
+	if (!nw || !nb) {
+		if (n < ws_cnt)
+			return;
+		log_err("Can't allocate memory for %d workspaces.", n);
+		exit(EXIT_FAILURE);
+	}
+	/* The first call also sets up the unused workspace 0. */
+	for (w = ws_cnt ? ws_cnt + 1 : 0; w <= n; w++) {
+		d = &ws_defaults[w < (int)LENGTH(ws_defaults) ? w : (int)LENGTH(ws_defaults) - 1];
+		wss[w] = (Workspace){ .layout = d->layout, .gap = d->gap,
+			.master_ratio = d->master_ratio,
+			.bar_height = d->bar_height };
+	}
+	ws_cnt = n;
 }
 
 /**
- * @brief Operator function to move the current focus up.
+ * @brief Change the amount of workspaces whilst howm is running.
  *
- * @param type Whether to focus on clients or workspaces.
- * @param cnt The number of times to move focus.
+ * The clients of workspaces that are removed are moved onto the new last
+ * workspace. An output that was showing a removed workspace is given the new
+ * last workspace if that is hidden, otherwise the nearest hidden workspace
+ * below it.
+ *
+ * @param n The amount of workspaces wanted. There are always at least as many
+ * workspaces as outputs.
  */
-void op_focus_up(const unsigned int type, int cnt)
+static void set_ws_count(int n)
 {
-	while (cnt > 0) {
-		if (type == CLIENT)
-			focus_next_client(NULL);
-		else if (type == WORKSPACE)
-			focus_next_ws(NULL);
-		else
-			return;
-		cnt--;
+	Client *c, *first;
+	Monitor *m;
+	unsigned int i;
+	int w, r;
+
+	if (n < (int)mon_cnt)
+		n = mon_cnt;
+	if (n > WORKSPACES_MAX)
+		n = WORKSPACES_MAX;
+	if (n == ws_cnt)
+		return;
+	log_info("Changing the amount of workspaces from %d to %d", ws_cnt, n);
+
+	for (w = ws_cnt; w > n; w--) {
+		m = ws_mon(w);
+		first = wss[w].head;
+		merge_ws(w, n);
+		if (m) {
+			for (r = n; ws_mon(r); r--)
+				;
+			m->ws = r;
+			/* If r is n, the clients from w are already shown. */
+			for (c = wss[r].head; c && c != first; c = c->next)
+				show_client(c);
+		} else if (ws_visible(n)) {
+			for (c = first; c; c = c->next)
+				show_client(c);
+		}
 	}
+	if (n < ws_cnt) {
+		for (i = 0; i < mon_cnt; i++) {
+			wss[mons[i].ws].dirty = true;
+			apply_pending(mons[i].ws);
+			arrange_ws(mons[i].ws);
+		}
+	}
+	resize_wss(n);
+
+	if (last_ws > n)
+		last_ws = 0;
+	cw = mons[cur_mon].ws;
+	if (wss[cw].current) {
+		restack_clients();
+		focus_current_client();
+	}
+	client_list_dirty = stacking_dirty = true;
+	xcb_ewmh_set_number_of_desktops(ewmh, 0, ws_cnt);
+	xcb_ewmh_set_current_desktop(ewmh, 0, cw - 1);
+	update_workarea();
+	howm_info();
 }
 
 /**
- * @brief Operator function to move the current focus down.
+ * @brief Move every client of one workspace onto the end of another.
  *
- * @param type Whether to focus on clients or workspaces.
- * @param cnt The number of times to move focus.
+ * @param from The workspace to be emptied.
+ * @param to The workspace that the clients are moved to.
  */
-void op_focus_down(const unsigned int type, int cnt)
+static void merge_ws(int from, int to)
 {
-	while (cnt > 0) {
-		if (type == CLIENT)
-			focus_prev_client(NULL);
-		else if (type == WORKSPACE)
-			focus_prev_ws(NULL);
-		else
-			return;
-		cnt--;
+	Client *first = wss[from].head, *last = wss[from].tail, *c;
+	unsigned int g;
+
+	if (!first)
+		return;
+	for (c = first; c; c = c->next) {
+		mru_del(from, c);
+		mru_add(to, c);
+		c->ws = to;
 	}
+	for (g = 0; g < LENGTH(wss[to].group_cnt); g++)
+		wss[to].group_cnt[g] += wss[from].group_cnt[g];
+	wss[to].urgent_cnt += wss[from].urgent_cnt;
+	wss[to].client_cnt += wss[from].client_cnt;
+	if (!wss[to].current)
+		wss[to].current = wss[from].current;
+	detach_run(from, first, last);
+	attach_run(to, wss[to].tail, first, last);
+	wss[from].current = NULL;
+	wss[from].client_cnt = 0;
+	memset(wss[from].group_cnt, 0, sizeof(wss[from].group_cnt));
+	wss[from].urgent_cnt = 0;
+	wss[to].dirty = true;
 }
 
 /**
- * @brief Deal with a window's request to change its geometry.
+ * @brief Keep track of which workspaces have clients, so that scans over
+ * every client only visit those.
  *
- * @param ev The event sent from the window.
+ * A workspace that has become empty also gives up its partition buffer and
+ * layout memo.
+ *
+ * @param ws The workspace whose client list has changed.
  */
-void configure_event(xcb_generic_event_t *ev)
+static void update_busy(int ws)
 {
-	xcb_configure_request_event_t *ce = (xcb_configure_request_event_t *)ev;
-	uint32_t vals[7] = {0}, i = 0;
+	Workspace *w = &wss[ws];
+	int last;
+
+	if (w->head && !w->busy_slot) {
+		busy_ws[busy_cnt++] = ws;
+		w->busy_slot = busy_cnt;
+	} else if (!w->head && w->busy_slot) {
+		last = busy_ws[--busy_cnt];
+		busy_ws[w->busy_slot - 1] = last;
+		wss[last].busy_slot = w->busy_slot;
+		w->busy_slot = 0;
+		free(w->part);
+		w->part = NULL;
+		w->part_cap = 0;
+		free(w->memo.geom);
+		w->memo.geom = NULL;
+		w->memo.cap = 0;
+	}
+}
+
+/**
+ * @brief Check whether a workspace is currently being displayed.
+ *
+ * @param ws The workspace to check.
+ *
+ * @return True if the clients of ws are on the screen.
+ */
+static bool ws_visible(int ws)
+{
+	return ws_mon(ws) != NULL;
+}
+
+/**
+ * @brief Find the output that a workspace is shown on.
+ *
+ * @param ws The workspace to search for.
+ *
+ * @return The output that is showing ws, NULL if ws is hidden.
+ */
+static Monitor *ws_mon(int ws)
+{
+	unsigned int i;
+
+	for (i = 0; i < mon_cnt; i++)
+		if (mons[i].ws == ws)
+			return &mons[i];
+	return NULL;
+}
+
+/**
+ * @brief Find the output that a workspace's clients should be arranged on.
+ *
+ * Hidden workspaces are laid out on the focused output, as that is where
+ * they will most likely be shown next.
+ *
+ * @param ws The workspace to search for.
+ *
+ * @return The output that is showing ws, or the focused output if ws is
+ * hidden.
+ */
+static Monitor *ws_output(int ws)
+{
+	Monitor *m = ws_mon(ws);
+
+	return m ? m : &mons[cur_mon];
+}
+
+/**
+ * @brief Work out the area that a workspace's clients can be arranged in.
+ *
+ * @param ws The workspace whose area should be found.
+ *
+ * @return The area of ws's output that isn't reserved for a bar.
+ */
+static xcb_rectangle_t ws_area(int ws)
+{
+	Monitor *m = ws_output(ws);
+	uint16_t bar;
+
+	bar = wss[ws].bar_height ? m->bar_height : 0;
+	return (xcb_rectangle_t){ m->x, m->y + (BAR_BOTTOM ? 0 : bar),
+		m->w, m->h - bar };
+}
+
+/**
+ * @brief Tell other programs about the area that each workspace's clients
+ * are arranged in, using _NET_WORKAREA.
+ */
+static void update_workarea(void)
+{
+	xcb_ewmh_geometry_t workarea[ws_cnt];
+	xcb_rectangle_t r;
+	int w;
+
+	for (w = 1; w <= ws_cnt; w++) {
+		r = ws_area(w);
+		workarea[w - 1] = (xcb_ewmh_geometry_t){ r.x, r.y, r.width, r.height };
+	}
+	xcb_ewmh_set_workarea(ewmh, 0, LENGTH(workarea), workarea);
+}
+
+/**
+ * @brief Send the changes that were made to a workspace whilst it was
+ * hidden.
+ *
+ * Geometry changes to the clients of a hidden workspace are only stored in
+ * memory. They are sent to the X server in one go here, just before the
+ * workspace is arranged and shown. Fullscreen and floating clients are also
+ * fitted to the output that the workspace is about to be shown on.
+ *
+ * @param ws The workspace that is about to be shown.
+ */
+static void apply_pending(int ws)
+{
+	Monitor *m;
+	Client *c;
+
+	if (!wss[ws].dirty)
+		return;
+	log_info("Applying pending changes to workspace <%d>", ws);
+	m = ws_output(ws);
+	for (c = wss[ws].head; c; c = c->next) {
+		/* The workspace may be shown on a different output to the one
+		 * that it was last shown on. */
+		if (c->is_fullscreen) {
+			change_client_geom(c, m->x, m->y, m->w, m->h);
+		} else if (c->is_floating && (c->x >= m->x + m->w || c->x + c->w <= m->x
+					|| c->y >= m->y + m->h || c->y + c->h <= m->y)) {
+			c->x = m->x + (m->w - c->w) / 2;
+			c->y = m->y + (m->h - c->h) / 2;
+		}
+		update_frame_extents(c);
+	}
+	wss[ws].dirty = false;
+}
+
+/**
+ * @brief Focus the given window, so long as it isn't already focused.
+ *
+ * If the window is on another workspace (such as one shown on a different
+ * output), that workspace is changed to first. Any cycling through the focus
+ * history is finished, as the pointer has chosen a client instead.
+ *
+ * @param win A window that belongs to a client being managed by howm.
+ */
+void focus_window(xcb_window_t win)
+{
+	Client *c = find_client_by_win(win);
+
+	end_mru_walk();
+	if (!c) {
+		/* We don't want warnings for clicking the root window... */
+		if (win != screen->root)
+			log_warn("No client owns the window <%d>", win);
+		return;
+	}
+	if (client_ws(c) != cw)
+		change_ws(&(Arg){ .i = client_ws(c) });
+	if (c != wss[cw].current)
+		update_focused_client(c);
+}
+
+/**
+ * @brief Operator function to move the current focus up.
+ *
+ * @param type Whether to focus on clients or workspaces.
+ * @param cnt The number of times to move focus.
+ */
+void op_focus_up(const unsigned int type, int cnt)
+{
+	Client *c = wss[cw].current;
+
+	if (type == CLIENT && c && (c = client_step(c, cnt)) != wss[cw].current) {
+		log_info("Focusing %d clients up", cnt);
+		update_focused_client(c);
+	} else if (type == WORKSPACE) {
+		log_info("Focusing %d workspaces up", cnt);
+		change_ws(&(Arg){ .i = correct_ws(cw + cnt) });
+	}
+}
+
+/**
+ * @brief Operator function to move the current focus down.
+ *
+ * @param type Whether to focus on clients or workspaces.
+ * @param cnt The number of times to move focus.
+ */
+void op_focus_down(const unsigned int type, int cnt)
+{
+	Client *c = wss[cw].current;
+
+	if (type == CLIENT && c && (c = client_step(c, -cnt)) != wss[cw].current) {
+		log_info("Focusing %d clients down", cnt);
+		update_focused_client(c);
+	} else if (type == WORKSPACE) {
+		log_info("Focusing %d workspaces down", cnt);
+		change_ws(&(Arg){ .i = correct_ws(cw - cnt) });
+	}
+}
+
+/**
+ * @brief Find the client that is a number of places away from another in the
+ * current workspace's client list, wrapping around its ends.
+ *
+ * Whichever direction is shorter is walked, so no more than half of the list
+ * is visited however large steps is.
+ *
+ * @param c The client to start from.
+ * @param steps How many places to move, forwards if positive and backwards if
+ * negative.
+ *
+ * @return The client steps places away from c.
+ */
+static Client *client_step(Client *c, int steps)
+{
+	int n = wss[cw].client_cnt;
+
+	steps = (steps % n + n) % n;
+	if (steps <= n / 2) {
+		for (; steps > 0; steps--)
+			c = c->next ? c->next : wss[cw].head;
+	} else {
+		for (steps = n - steps; steps > 0; steps--)
+			c = c->prev ? c->prev : wss[cw].tail;
+	}
+	return c;
+}
+
+/**
+ * @brief Deal with a window's request to change its geometry.
+ *
+ * Requests from windows that howm doesn't manage are passed straight through.
+ * A floating client on a hidden workspace has its requested geometry stored,
+ * so that it can be applied when the workspace is next shown. Clients on
+ * hidden workspaces are told their actual geometry, as the request isn't
+ * carried out. So are stowed scratchpads, which aren't in the window index and
+ * would otherwise be moved back on screen by the passthrough.
+ *
+ * @param ev The event sent from the window.
+ */
+void configure_event(xcb_generic_event_t *ev)
+{
+	xcb_configure_request_event_t *ce = (xcb_configure_request_event_t *)ev;
+	uint32_t vals[7] = {0}, i = 0;
 	Client *c = find_client_by_win(ce->window);
+	int ws = c ? client_ws(c) : 0;
+	Client **s;
 
-	if (!c)
+	if (!c && (s = stowed_slot(ce->window))) {
+		log_info("Refusing configure request for stowed window <%d>", ce->window);
+		send_configure_notify(*s);
+		return;
+	}
+	if (c && (!ws || !ws_visible(ws))) {
+		log_info("Deferring configure request for hidden client <%p>", c);
+		if (c->is_floating && !c->is_fullscreen) {
+			if (XCB_CONFIG_WINDOW_X & ce->value_mask)
+				c->x = ce->x;
+			if (XCB_CONFIG_WINDOW_Y & ce->value_mask)
+				c->y = ce->y;
+			if (XCB_CONFIG_WINDOW_WIDTH & ce->value_mask)
+				c->w = ce->width;
+			if (XCB_CONFIG_WINDOW_HEIGHT & ce->value_mask)
+				c->h = ce->height;
+		}
+		if (ws)
+			wss[ws].dirty = true;
+		send_configure_notify(c);
 		return;
-	log_info("Received configure request for client <%p>", c);
+	}
+	log_info("Received configure request for window <%d>", ce->window);
 
 	/* TODO: Need to test whether gaps etc need to be taken into account
 	 * here. */
 	if (XCB_CONFIG_WINDOW_X & ce->value_mask)
 		vals[i++] = ce->x;
 	if (XCB_CONFIG_WINDOW_Y & ce->value_mask)
-		vals[i++] = ce->y + (BAR_BOTTOM ? 0 : wss[cw].bar_height);
+		vals[i++] = ce->y + (c && !BAR_BOTTOM && wss[ws].bar_height ? ws_output(ws)->bar_height : 0);
 	if (XCB_CONFIG_WINDOW_WIDTH & ce->value_mask)
 		vals[i++] = (ce->width < screen_width - BORDER_PX) ? ce->width : screen_width - BORDER_PX;
 	if (XCB_CONFIG_WINDOW_HEIGHT & ce->value_mask)
@@ -1840,59 +3719,320 @@ void configure_event(xcb_generic_event_t *ev)
 	if (XCB_CONFIG_WINDOW_STACK_MODE & ce->value_mask)
 		vals[i++] = ce->stack_mode;
 	xcb_configure_window(dpy, ce->window, ce->value_mask, vals);
-	arrange_windows();
+	if (c)
+		arrange_ws(ws);
+}
+
+/**
+ * @brief Send a client a synthetic ConfigureNotify giving its actual
+ * geometry.
+ *
+ * ICCCM 4.1.5 asks for this when a configure request isn't carried out, and
+ * some toolkits wait for it. The geometry is worked out from what is stored
+ * in the client, in the same way as draw_client(), so no round trip is
+ * needed.
+ *
+ * @param c The client, which may be stowed.
+ */
+static void send_configure_notify(Client *c)
+{
+	xcb_configure_notify_event_t ce;
+	xcb_rectangle_t r = { c->x, c->y, c->w, c->h };
+	uint16_t bw = BORDER_PX;
+	int ws = client_ws(c);
+
+	/* Stowed clients aren't on a workspace and are drawn floating. */
+	if (ws)
+		r = client_frame(ws, c, &bw);
+	if (c->is_parked)
+		r.x = c->park_x;
+	memset(&ce, 0, sizeof(ce));
+	ce.response_type = XCB_CONFIGURE_NOTIFY;
+	ce.event = c->win;
+	ce.window = c->win;
+	ce.above_sibling = XCB_NONE;
+	ce.x = r.x;
+	ce.y = r.y;
+	ce.width = r.width;
+	ce.height = r.height;
+	ce.border_width = bw;
+	ce.override_redirect = false;
+	xcb_send_event(dpy, false, c->win, XCB_EVENT_MASK_STRUCTURE_NOTIFY,
+			(char *)&ce);
 }
 
 /**
  * @brief Remove clients that wish to be unmapped.
  *
+ * UnmapNotify events that are caused by howm unmapping a window itself are
+ * expected and simply counted off. Only a client withdrawing its own window
+ * (or sending a synthetic UnmapNotify, as ICCCM asks) causes it to be
+ * removed.
+ *
  * @param ev An event letting us know which client should be unmapped.
  */
 void unmap_event(xcb_generic_event_t *ev)
 {
 	xcb_unmap_notify_event_t *ue = (xcb_unmap_notify_event_t *)ev;
 	Client *c = find_client_by_win(ue->window);
-
+	bool synthetic = ev->response_type & 0x80;
+	struct segment *seg = NULL;
+	Client **s = NULL;
+	int ws;
+
+	if (!c && (s = stowed_slot(ue->window)))
+		c = *s;
+	else if (!c)
+		seg = reg_find(&del_reg, ue->window, &c);
 	if (!c)
 		return;
-	log_info("Received unmap request for client <%p>", c);
-
-	if (!ue->event == screen->root) {
-		remove_client(c);
-		arrange_windows();
+	if (c->unmaps_expected > 0 && !synthetic) {
+		c->unmaps_expected--;
+		return;
 	}
+	if (s) {
+		drop_stowed(s);
+		return;
+	}
+	if (seg) {
+		reg_forget(&del_reg, seg, c);
+		return;
+	}
+	log_info("Client <%p> has withdrawn its window", c);
+
+	ws = client_ws(c);
+	remove_client(c);
+	if (ws_visible(ws))
+		arrange_ws(ws);
+	else
+		wss[ws].dirty = true;
 	howm_info();
 }
 
+/**
+ * @brief Handles property changes, keeping the cached properties that rules
+ * match against up to date.
+ *
+ * @param ev A property notify event.
+ */
+void property_event(xcb_generic_event_t *ev)
+{
+	xcb_property_notify_event_t *pe = (xcb_property_notify_event_t *)ev;
+	unsigned int which;
+	Client *c, **s;
+
+	if (pe->atom == XCB_ATOM_WM_CLASS)
+		which = 1 << PROP_INSTANCE | 1 << PROP_CLASS;
+	else if (pe->atom == XCB_ATOM_WM_NAME || pe->atom == ewmh->_NET_WM_NAME)
+		which = 1 << PROP_TITLE;
+	else if (pe->atom == wm_atoms[WM_WINDOW_ROLE])
+		which = 1 << PROP_ROLE;
+	else
+		return;
+	c = find_client_by_win(pe->window);
+	/* Stowed scratchpads aren't in the index, but are still cached. */
+	if (!c && (s = stowed_slot(pe->window)))
+		c = *s;
+	if (!c)
+		return;
+	log_debug("Property %d of window <%d> changed", pe->atom, pe->window);
+	fetch_props(c->win, c->props, which);
+}
+
 /**
  * @brief Arrange the client's windows on the screen.
  *
  * This function takes some strain off of the layout handlers by passing the
  * client's dimensions to move_resize. This splits the layout handlers into
  * smaller, more understandable parts.
+ *
+ * @param ws The workspace whose clients should be drawn.
  */
-void draw_clients(void)
+void draw_clients(int ws)
 {
 	Client *c = NULL;
 
 	log_debug("Drawing clients");
-	for (c = wss[cw].head; c; c = c->next)
-		if (wss[cw].layout == ZOOM && ZOOM_GAP && !c->is_floating) {
-			set_border_width(c->win, 0);
-			move_resize(c->win, c->x + c->gap, c->y + c->gap,
-					c->w - (2 * c->gap), c->h - (2 * c->gap));
-		} else if (c->is_floating) {
-			set_border_width(c->win, BORDER_PX);
-			move_resize(c->win, c->x, c->y,
-					c->w, c->h);
-		} else if (c->is_fullscreen || wss[cw].layout == ZOOM) {
-			set_border_width(c->win, 0);
-			move_resize(c->win, c->x, c->y, c->w, c->h);
-		} else {
-			move_resize(c->win, c->x + c->gap, c->y + c->gap,
-					c->w - (2 * (c->gap + BORDER_PX)),
-					c->h - (2 * (c->gap + BORDER_PX)));
+	for (c = wss[ws].head; c; c = c->next)
+		draw_client(ws, c);
+}
+
+/**
+ * @brief Draw the tiles that a layout handler has filled in, followed by the
+ * clients that aren't tiled.
+ *
+ * The tiles are stored in their clients, then the gaps and borders are
+ * applied to all of them at once before they are sent to the X server.
+ *
+ * @param ws The workspace that has been arranged.
+ * @param n The amount of tiles.
+ */
+static void draw_tiles(int ws, unsigned int n)
+{
+	bool zoomed = wss[ws].layout == ZOOM;
+	/* Both are multipliers, so that every layout can share one loop
+	 * without any branches in it. */
+	uint16_t off = zoomed && !ZOOM_GAP ? 0 : 1;
+	uint16_t bw = zoomed ? 0 : BORDER_PX;
+	unsigned int i;
+
+	log_debug("Drawing %u tiles", n);
+	for (i = 0; i < n; i++)
+		change_client_geom(tiles.c[i], tiles.x[i], tiles.y[i], tiles.w[i], tiles.h[i]);
+	inset_tiles(tiles.x, tiles.y, tiles.w, tiles.h, tiles.g, n, off, bw);
+	for (i = 0; i < n; i++) {
+		if (zoomed)
+			set_border_width(tiles.c[i]->win, 0);
+		move_resize(tiles.c[i]->win, tiles.x[i], tiles.y[i], tiles.w[i], tiles.h[i]);
+	}
+	for (i = n; i < tiles.len; i++)
+		draw_client(ws, tiles.c[i]);
+}
+
+/**
+ * @brief Shrink each tile by its gap and border.
+ *
+ * The arrays never overlap, which is promised with restrict so that the loop
+ * can be vectorised.
+ *
+ * @param x The x coordinates of the tiles.
+ * @param y The y coordinates of the tiles.
+ * @param w The widths of the tiles.
+ * @param h The heights of the tiles.
+ * @param g The gap of each tile.
+ * @param n The amount of tiles.
+ * @param off 1 if the gaps should be applied, else 0.
+ * @param bw The width of the border around each tile.
+ */
+static void inset_tiles(int16_t *restrict x, int16_t *restrict y,
+		uint16_t *restrict w, uint16_t *restrict h,
+		const uint16_t *restrict g, unsigned int n, uint16_t off, uint16_t bw)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		x[i] += off * g[i];
+		y[i] += off * g[i];
+		w[i] -= 2 * (off * g[i] + bw);
+		h[i] -= 2 * (off * g[i] + bw);
+	}
+}
+
+/**
+ * @brief Fill the tile arrays in from a workspace's memo, if the memo was
+ * computed from the same inputs.
+ *
+ * The layouts only depend on the amount of tiles, the area, the layout itself
+ * and the master ratio. So most arrangements, such as those after a change
+ * of focus, can reuse the last geometry instead of working it out again.
+ *
+ * @param ws The workspace being arranged.
+ * @param layout The layout that is arranging it.
+ * @param n The amount of tiles.
+ * @param r The area that the tiles are fitted into.
+ *
+ * @return True if the tile arrays were filled in.
+ */
+static bool memo_restore(int ws, int layout, unsigned int n, xcb_rectangle_t r)
+{
+	struct layout_memo *m = &wss[ws].memo;
+
+	if (!m->geom || m->layout != layout || m->n != n
+			|| m->master_ratio != wss[ws].master_ratio
+			|| m->area.x != r.x || m->area.y != r.y
+			|| m->area.width != r.width || m->area.height != r.height) {
+		memo_misses++;
+		return false;
+	}
+	memo_hits++;
+	log_debug("Reusing layout of workspace <%d> (%lu hits, %lu misses)",
+			ws, memo_hits, memo_misses);
+	memcpy(tiles.x, m->geom, n * sizeof(int16_t));
+	memcpy(tiles.y, m->geom + m->cap, n * sizeof(int16_t));
+	memcpy(tiles.w, m->geom + 2 * m->cap, n * sizeof(uint16_t));
+	memcpy(tiles.h, m->geom + 3 * m->cap, n * sizeof(uint16_t));
+	return true;
+}
+
+/**
+ * @brief Remember the tiles that a layout handler has just computed.
+ *
+ * @param ws The workspace being arranged.
+ * @param layout The layout that arranged it.
+ * @param n The amount of tiles.
+ * @param r The area that the tiles were fitted into.
+ */
+static void memo_store(int ws, int layout, unsigned int n, xcb_rectangle_t r)
+{
+	struct layout_memo *m = &wss[ws].memo;
+	unsigned int cap = m->cap;
+	uint16_t *geom;
+
+	if (!m->geom || n > cap) {
+		for (cap = cap ? cap : 16; cap < n; cap *= 2)
+			;
+		geom = realloc(m->geom, 4 * cap * sizeof(uint16_t));
+		if (!geom) {
+			log_warn("Can't allocate memory for the layout memo.");
+			return;
 		}
+		m->geom = geom;
+		m->cap = cap;
+	}
+	m->layout = layout;
+	m->n = n;
+	m->master_ratio = wss[ws].master_ratio;
+	m->area = r;
+	memcpy(m->geom, tiles.x, n * sizeof(int16_t));
+	memcpy(m->geom + cap, tiles.y, n * sizeof(int16_t));
+	memcpy(m->geom + 2 * cap, tiles.w, n * sizeof(uint16_t));
+	memcpy(m->geom + 3 * cap, tiles.h, n * sizeof(uint16_t));
+}
+
+/**
+ * @brief Draw a single client, using the geometry stored in it.
+ *
+ * @param ws The workspace that the client is on.
+ * @param c The client to be drawn.
+ */
+static void draw_client(int ws, Client *c)
+{
+	uint16_t bw;
+	xcb_rectangle_t r = client_frame(ws, c, &bw);
+
+	/* Tiled clients otherwise keep the border they were focused with. */
+	if (c->is_floating || !bw)
+		set_border_width(c->win, bw);
+	move_resize(c->win, r.x, r.y, r.width, r.height);
+}
+
+/**
+ * @brief Work out where draw_client() puts a client's window, once its gap
+ * and border are taken into account.
+ *
+ * @param ws The workspace that the client is on.
+ * @param c The client.
+ * @param bw Where the width of the window's border is stored.
+ *
+ * @return The position and size of the window.
+ */
+static xcb_rectangle_t client_frame(int ws, const Client *c, uint16_t *bw)
+{
+	if (wss[ws].layout == ZOOM && ZOOM_GAP && !c->is_floating) {
+		*bw = 0;
+		return (xcb_rectangle_t){ c->x + c->gap, c->y + c->gap,
+				c->w - (2 * c->gap), c->h - (2 * c->gap) };
+	} else if (c->is_floating) {
+		*bw = BORDER_PX;
+		return (xcb_rectangle_t){ c->x, c->y, c->w, c->h };
+	} else if (c->is_fullscreen || wss[ws].layout == ZOOM) {
+		*bw = 0;
+		return (xcb_rectangle_t){ c->x, c->y, c->w, c->h };
+	}
+	*bw = BORDER_PX;
+	return (xcb_rectangle_t){ c->x + c->gap, c->y + c->gap,
+			c->w - (2 * (c->gap + BORDER_PX)),
+			c->h - (2 * (c->gap + BORDER_PX)) };
 }
 
 /**
@@ -1904,7 +4044,7 @@ void draw_clients(void)
  * @param w The width of the client's window.
  * @param h The height of the client's window.
  */
-void change_client_geom(Client *c, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+void change_client_geom(Client *c, int16_t x, int16_t y, uint16_t w, uint16_t h)
 {
 	log_debug("Changing geometry of client <%p> from {%d, %d, %d, %d} to {%d, %d, %d, %d}",
 			c, c->x, c->y, c->w, c->h, x, y, w, h);
@@ -1949,6 +4089,9 @@ static void op_grow_gaps(const unsigned int type, int cnt)
 /**
  * @brief A helper function to change the size of a client's gaps.
  *
+ * Only the stored gap is changed, the caller is responsible for letting the X
+ * server know.
+ *
  * @param c The client who's gap size should be changed.
  * @param size The size by which the gap should be changed.
  */
@@ -1960,16 +4103,30 @@ static void change_client_gaps(Client *c, int size)
 		c->gap = 0;
 	else
 		c->gap += size;
+}
 
+/**
+ * @brief Tell a client how much space is taken up by its gap and border.
+ *
+ * @param c The client that should have its _NET_FRAME_EXTENTS updated.
+ */
+static void update_frame_extents(Client *c)
+{
 	uint32_t space = c->gap + BORDER_PX;
 
 	xcb_ewmh_set_frame_extents(ewmh, c->win, space, space, space, space);
-	draw_clients();
 }
 
 /**
  * @brief Does the heavy lifting of changing the gaps of clients.
  *
+ * Workspaces that aren't visible only have their gaps changed in memory, the
+ * new gaps are sent when the workspace is next shown.
+ *
+ * When cnt wraps around the clients or workspaces, those that would be changed
+ * more than once have their changes added up, so that each is only changed
+ * and drawn once.
+ *
  * @param type Whether to perform the operation on a client or workspace.
  * @param cnt The amount of times to perform the operation.
  * @param size The amount of pixels to change the gap size by. This is
@@ -1978,24 +4135,38 @@ static void change_client_gaps(Client *c, int size)
 static void change_gaps(const unsigned int type, int cnt, int size)
 {
 	Client *c = NULL;
+	int ws, i, n, delta;
 
 	if (type == WORKSPACE) {
-		while (cnt > 0) {
-			cnt--;
-			wss[correct_ws(cw + cnt)].gap += size;
+		n = cnt < ws_cnt ? cnt : ws_cnt;
+		for (i = 0; i < n; i++) {
+			ws = correct_ws(cw + i);
+			delta = size * (cnt / ws_cnt + (i < cnt % ws_cnt));
+			wss[ws].gap = (int)wss[ws].gap + delta <= 0 ? 0
+				: wss[ws].gap + delta;
 			log_info("Changing gaps of workspace <%d> by %dpx",
-					correct_ws(cw + cnt), size);
-			for (c = wss[correct_ws(cw + cnt)].head; c; c = c->next)
-				change_client_gaps(c, size);
+					ws, delta);
+			for (c = wss[ws].head; c; c = c->next)
+				change_client_gaps(c, delta);
+			if (!ws_visible(ws)) {
+				wss[ws].dirty = true;
+				continue;
+			}
+			for (c = wss[ws].head; c; c = c->next)
+				update_frame_extents(c);
+			draw_clients(ws);
 		}
-	} else if (type == CLIENT) {
+	} else if (type == CLIENT && wss[cw].current) {
 		c = wss[cw].current;
-		while (cnt > 0) {
-			log_info("Changing gaps of client <%p> by %dpx", c, size);
-			change_client_gaps(c, size);
-			c = next_client(c);
-			cnt--;
+		n = cnt < wss[cw].client_cnt ? cnt : wss[cw].client_cnt;
+		for (i = 0; i < n; i++, c = c->next ? c->next : wss[cw].head) {
+			delta = size * (cnt / wss[cw].client_cnt
+					+ (i < cnt % wss[cw].client_cnt));
+			log_info("Changing gaps of client <%p> by %dpx", c, delta);
+			change_client_gaps(c, delta);
+			update_frame_extents(c);
 		}
+		draw_clients(cw);
 	}
 
 }
@@ -2007,14 +4178,20 @@ static void change_gaps(const unsigned int type, int cnt, int size)
  */
 static void toggle_float(const Arg *arg)
 {
+	xcb_rectangle_t r;
+	unsigned int group;
+
 	UNUSED(arg);
 	if (!wss[cw].current)
 		return;
 	log_info("Toggling floating state of client <%p>", wss[cw].current);
+	group = stacking_group(wss[cw].current);
 	wss[cw].current->is_floating = !wss[cw].current->is_floating;
+	regroup_client(wss[cw].current, group);
 	if (wss[cw].current->is_floating && CENTER_FLOATING) {
-		wss[cw].current->x = (screen_width / 2) - (wss[cw].current->w / 2);
-		wss[cw].current->y = (screen_height - wss[cw].bar_height - wss[cw].current->h) / 2;
+		r = ws_area(cw);
+		wss[cw].current->x = r.x + (r.width - wss[cw].current->w) / 2;
+		wss[cw].current->y = r.y + (r.height - wss[cw].current->h) / 2;
 		log_info("Centering client <%p>", wss[cw].current);
 	}
 	arrange_windows();
@@ -2034,7 +4211,7 @@ static void resize_float_width(const Arg *arg)
 		return;
 	log_info("Resizing width of client <%p> from %d by %d", wss[cw].current, wss[cw].current->w, arg->i);
 	wss[cw].current->w += arg->i;
-	draw_clients();
+	draw_clients(cw);
 }
 
 /**
@@ -2051,7 +4228,7 @@ static void resize_float_height(const Arg *arg)
 		return;
 	log_info("Resizing height of client <%p> from %d to %d", wss[cw].current, wss[cw].current->h, arg->i);
 	wss[cw].current->h += arg->i;
-	draw_clients();
+	draw_clients(cw);
 }
 
 /**
@@ -2068,7 +4245,7 @@ static void move_float_y(const Arg *arg)
 		return;
 	log_info("Changing y of client <%p> from %d to %d", wss[cw].current, wss[cw].current->y, arg->i);
 	wss[cw].current->y += arg->i;
-	draw_clients();
+	draw_clients(cw);
 
 }
 
@@ -2086,58 +4263,141 @@ static void move_float_x(const Arg *arg)
 		return;
 	log_info("Changing x of client <%p> from %d to %d", wss[cw].current, wss[cw].current->x, arg->i);
 	wss[cw].current->x += arg->i;
-	draw_clients();
+	draw_clients(cw);
 
 }
 
 /**
- * @brief Teleport a floating client's window to a location on the screen.
+ * @brief Start moving a floating client with the mouse.
  *
- * @param arg Which location to teleport the window to.
+ * @param arg Unused.
  */
-static void teleport_client(const Arg *arg)
+static void mouse_move(const Arg *arg)
 {
-	if (!wss[cw].current || !wss[cw].current->is_floating
-			|| wss[cw].current->is_transient)
-		return;
+	UNUSED(arg);
+	start_drag(false);
+}
 
-	/* A bit naughty, but it looks nicer- doesn't it?*/
-	uint16_t g = wss[cw].current->gap;
-	uint16_t w = wss[cw].current->w;
-	uint16_t h = wss[cw].current->h;
-	uint16_t bh = wss[cw].bar_height;
+/**
+ * @brief Start resizing a floating client with the mouse.
+ *
+ * @param arg Unused.
+ */
+static void mouse_resize(const Arg *arg)
+{
+	UNUSED(arg);
+	start_drag(true);
+}
 
-	switch (arg->i) {
-	case TOP_LEFT:
-		wss[cw].current->x = g;
-		wss[cw].current->y = (BAR_BOTTOM ? 0 : bh) + g;
-		break;
+/**
+ * @brief Grab the pointer so that the client under it follows the pointer
+ * until the button is released.
+ *
+ * button_press_event() sets the client and the pointer's position before the
+ * button's function is called.
+ *
+ * @param resize Whether the client should be resized, rather than moved.
+ */
+static void start_drag(bool resize)
+{
+	if (!drag.c || !drag.c->is_floating || drag.c->is_fullscreen
+			|| !ws_visible(client_ws(drag.c))) {
+		drag.c = NULL;
+		return;
+	}
+	log_info("Started %s client <%p>", resize ? "resizing" : "moving", drag.c);
+	drag.resize = resize;
+	drag.x = drag.c->x;
+	drag.y = drag.c->y;
+	drag.w = drag.c->w;
+	drag.h = drag.c->h;
+	if (drag.c != wss[cw].current)
+		update_focused_client(drag.c);
+	xcb_grab_pointer(dpy, 0, screen->root, XCB_EVENT_MASK_BUTTON_RELEASE
+			| XCB_EVENT_MASK_BUTTON_MOTION, XCB_GRAB_MODE_ASYNC,
+			XCB_GRAB_MODE_ASYNC, XCB_WINDOW_NONE, XCB_CURSOR_NONE,
+			XCB_CURRENT_TIME);
+}
+
+/**
+ * @brief Move or resize the dragged client, relative to where the pointer
+ * was when the drag began.
+ *
+ * Only the dragged client is reconfigured, the rest of the workspace is left
+ * alone.
+ *
+ * @param x The pointer's current x coordinate.
+ * @param y The pointer's current y coordinate.
+ */
+static void drag_to(int16_t x, int16_t y)
+{
+	int dx = x - drag.ptr_x;
+	int dy = y - drag.ptr_y;
+	Client *c = drag.c;
+
+	if (drag.resize) {
+		c->w = (int)drag.w + dx > 1 ? drag.w + dx : 1;
+		c->h = (int)drag.h + dy > 1 ? drag.h + dy : 1;
+	} else {
+		c->x = drag.x + dx;
+		c->y = drag.y + dy;
+	}
+	move_resize(c->win, c->x, c->y, c->w, c->h);
+}
+
+/**
+ * @brief Teleport a floating client's window to a location on the screen.
+ *
+ * @param arg Which location to teleport the window to.
+ */
+static void teleport_client(const Arg *arg)
+{
+	if (!wss[cw].current || !wss[cw].current->is_floating
+			|| wss[cw].current->is_transient)
+		return;
+
+	/* A bit naughty, but it looks nicer- doesn't it?*/
+	uint16_t g = wss[cw].current->gap;
+	uint16_t w = wss[cw].current->w;
+	uint16_t h = wss[cw].current->h;
+	xcb_rectangle_t r = ws_area(cw);
+	int16_t left = r.x + g;
+	int16_t hcentre = r.x + (r.width - w) / 2;
+	int16_t right = r.x + r.width - w - g - (2 * BORDER_PX);
+	int16_t top = r.y + g;
+	int16_t bottom = r.y + r.height - h - g - (2 * BORDER_PX);
+
+	switch (arg->i) {
+	case TOP_LEFT:
+		wss[cw].current->x = left;
+		wss[cw].current->y = top;
+		break;
 	case TOP_CENTER:
-		wss[cw].current->x = (screen_width - w) / 2;
-		wss[cw].current->y = (BAR_BOTTOM ? 0 : bh) + g;
+		wss[cw].current->x = hcentre;
+		wss[cw].current->y = top;
 		break;
 	case TOP_RIGHT:
-		wss[cw].current->x = screen_width - w - g - (2 * BORDER_PX);
-		wss[cw].current->y = (BAR_BOTTOM ? 0 : bh) + g;
+		wss[cw].current->x = right;
+		wss[cw].current->y = top;
 		break;
 	case CENTER:
-		wss[cw].current->x = (screen_width - w) / 2;
-		wss[cw].current->y = (screen_height - bh - h) / 2;
+		wss[cw].current->x = hcentre;
+		wss[cw].current->y = r.y + (r.height - h) / 2;
 		break;
 	case BOTTOM_LEFT:
-		wss[cw].current->x = g;
-		wss[cw].current->y = (BAR_BOTTOM ? screen_height - bh : screen_height) - h - g - (2 * BORDER_PX);
+		wss[cw].current->x = left;
+		wss[cw].current->y = bottom;
 		break;
 	case BOTTOM_CENTER:
-		wss[cw].current->x = (screen_width / 2) - (w / 2);
-		wss[cw].current->y = (BAR_BOTTOM ? screen_height - bh : screen_height) - h - g - (2 * BORDER_PX);
+		wss[cw].current->x = hcentre;
+		wss[cw].current->y = bottom;
 		break;
 	case BOTTOM_RIGHT:
-		wss[cw].current->x = screen_width - w - g - (2 * BORDER_PX);
-		wss[cw].current->y = (BAR_BOTTOM ? screen_height - bh : screen_height) - h - g - (2 * BORDER_PX);
+		wss[cw].current->x = right;
+		wss[cw].current->y = bottom;
 		break;
 	};
-	draw_clients();
+	draw_clients(cw);
 }
 
 /**
@@ -2163,6 +4423,7 @@ static void cleanup(void)
 	xcb_window_t *w;
 	xcb_query_tree_reply_t *q;
 	uint16_t i;
+	unsigned int j;
 
 	log_warn("Cleaning up");
 	xcb_ungrab_key(dpy, XCB_GRAB_ANY, screen->root, XCB_MOD_MASK_ANY);
@@ -2179,7 +4440,24 @@ static void cleanup(void)
 	xcb_ewmh_connection_wipe(ewmh);
 	if (ewmh)
 		free(ewmh);
-	stack_free(&del_reg);
+	reg_free(&del_reg);
+	free(clients_by_win.slots);
+	client_pool_free(&clients);
+	free_matcher(&matcher);
+	log_info("Layout memo: %lu hits, %lu misses", memo_hits, memo_misses);
+	for (j = 0; j < MACRO_REGISTERS; j++)
+		free(macros[j].steps);
+	for (j = 0; j < busy_cnt; j++) {
+		free(wss[busy_ws[j]].part);
+		free(wss[busy_ws[j]].memo.geom);
+	}
+	free(wss);
+	free(busy_ws);
+	free(tiles.x);
+	free(tiles.y);
+	free(tiles.w);
+	free(tiles.h);
+	free(tiles.g);
 }
 
 /**
@@ -2203,6 +4481,33 @@ static void delete_win(xcb_window_t win)
 	xcb_flush(dpy);
 }
 
+/**
+ * @brief Close a window, politely if it supports WM_DELETE_WINDOW and by
+ * killing its client otherwise.
+ *
+ * @param win The window to be closed.
+ */
+static void close_win(xcb_window_t win)
+{
+	xcb_icccm_get_wm_protocols_reply_t rep;
+	unsigned int i;
+	bool found = false;
+
+	if (xcb_icccm_get_wm_protocols_reply(dpy,
+				xcb_icccm_get_wm_protocols(dpy, win,
+					wm_atoms[WM_PROTOCOLS]), &rep, NULL)) {
+		for (i = 0; i < rep.atoms_len; ++i)
+			if (rep.atoms[i] == wm_atoms[WM_DELETE_WINDOW]) {
+				delete_win(win);
+				found = true;
+				break;
+			}
+		xcb_icccm_get_wm_protocols_reply_wipe(&rep);
+	}
+	if (!found)
+		xcb_kill_client(dpy, win);
+}
+
 /**
  * @brief Resize the master window of a stack for the current workspace.
  *
@@ -2243,9 +4548,7 @@ static void toggle_bar(const Arg *arg)
 	} else {
 		return;
 	}
-	xcb_ewmh_geometry_t workarea[] = { { 0, BAR_BOTTOM ? 0 : wss[cw].bar_height,
-				screen_width, screen_height - wss[cw].bar_height } };
-	xcb_ewmh_set_workarea(ewmh, 0, LENGTH(workarea), workarea);
+	update_workarea();
 	arrange_windows();
 }
 
@@ -2253,35 +4556,28 @@ static void toggle_bar(const Arg *arg)
  * @brief Convert a window into a client.
  *
  * @param w A valid xcb window.
+ * @param ws The workspace that the client should be added to.
  *
  * @return A client that has already been inserted into the linked list of
  * clients.
  */
-Client *create_client(xcb_window_t w)
+Client *create_client(xcb_window_t w, int ws)
 {
-	Client *c = (Client *)calloc(1, sizeof(Client));
-	Client *t = prev_client(wss[cw].head, cw); /* Get the last element. */
+	Client *c = client_alloc(&clients);
 	uint32_t vals[1] = { XCB_EVENT_MASK_PROPERTY_CHANGE |
 				 (FOCUS_MOUSE ? XCB_EVENT_MASK_ENTER_WINDOW : 0)};
 
-	if (!c) {
-		log_err("Can't allocate memory for client.");
-		exit(EXIT_FAILURE);
-	}
-	if (!wss[cw].head)
-		wss[cw].head = c;
-	else if (t)
-		t->next = c;
-	else
-		wss[cw].head->next = c;
+	attach_client(ws, wss[ws].tail, c);
+	mru_add(ws, c);
 	c->win = w;
-	c->gap = wss[cw].gap;
+	c->ws = ws;
+	c->gap = wss[ws].gap;
+	win_index_put(&clients_by_win, c);
 	xcb_change_window_attributes(dpy, c->win, XCB_CW_EVENT_MASK, vals);
-	uint32_t space = c->gap + BORDER_PX;
-
-	xcb_ewmh_set_frame_extents(ewmh, c->win, space, space, space, space);
-	log_info("Created client <%p>", c);
-	wss[cw].client_cnt++;
+	update_frame_extents(c);
+	ewmh_append_client(c);
+	log_info("Created client <%p> on workspace <%d>", c, ws);
+	wss[ws].client_cnt++;
 	return c;
 }
 
@@ -2298,8 +4594,8 @@ static void make_master(const Arg *arg)
 			|| !(wss[cw].layout == HSTACK
 			|| wss[cw].layout == VSTACK))
 		return;
-	while (wss[cw].current != wss[cw].head)
-		move_up(wss[cw].current);
+	detach_client(cw, wss[cw].current);
+	attach_client(cw, NULL, wss[cw].current);
 	update_focused_client(wss[cw].head);
 }
 
@@ -2310,8 +4606,6 @@ static void make_master(const Arg *arg)
 void setup_ewmh(void)
 {
 	xcb_ewmh_coordinates_t viewport[] = { {0, 0} };
-	xcb_ewmh_geometry_t workarea[] = { {0, BAR_BOTTOM ? 0 : wss[cw].bar_height,
-		 screen_width, screen_height - wss[cw].bar_height} };
 
 	ewmh = calloc(1, sizeof(xcb_ewmh_connection_t));
 	if (!ewmh) {
@@ -2328,22 +4622,94 @@ void setup_ewmh(void)
 				ewmh->_NET_WM_STATE,
 				ewmh->_NET_CLOSE_WINDOW,
 				ewmh->_NET_WM_STATE_FULLSCREEN,
+				ewmh->_NET_WM_STATE_HIDDEN,
 				ewmh->_NET_CURRENT_DESKTOP,
 				ewmh->_NET_NUMBER_OF_DESKTOPS,
 				ewmh->_NET_DESKTOP_GEOMETRY,
 				ewmh->_NET_WORKAREA,
-				ewmh->_NET_ACTIVE_WINDOW };
+				ewmh->_NET_ACTIVE_WINDOW,
+				ewmh->_NET_CLIENT_LIST,
+				ewmh->_NET_CLIENT_LIST_STACKING };
 
 	xcb_ewmh_set_supported(ewmh, 0, LENGTH(ewmh_net_atoms), ewmh_net_atoms);
 	xcb_ewmh_set_supporting_wm_check(ewmh, 0, screen->root);
 	xcb_ewmh_set_desktop_viewport(ewmh, 0, LENGTH(viewport), viewport);
 	xcb_ewmh_set_wm_name(ewmh, 0, strlen("howm"), "howm");
 	xcb_ewmh_set_current_desktop(ewmh, 0, DEFAULT_WORKSPACE);
-	xcb_ewmh_set_number_of_desktops(ewmh, 0, WORKSPACES);
-	xcb_ewmh_set_workarea(ewmh, 0, LENGTH(workarea), workarea);
+	xcb_ewmh_set_number_of_desktops(ewmh, 0, ws_cnt);
+	update_workarea();
 	xcb_ewmh_set_desktop_geometry(ewmh, 0, screen_width, screen_height);
 }
 
+/**
+ * @brief Add a newly managed client to the end of _NET_CLIENT_LIST and the
+ * top of _NET_CLIENT_LIST_STACKING.
+ *
+ * Nothing is appended to a list that is going to be rewritten anyway.
+ *
+ * @param c The new client.
+ */
+static void ewmh_append_client(Client *c)
+{
+	if (!client_list_dirty)
+		xcb_change_property(dpy, XCB_PROP_MODE_APPEND, screen->root,
+				ewmh->_NET_CLIENT_LIST, XCB_ATOM_WINDOW, 32, 1,
+				&c->win);
+	if (!stacking_dirty)
+		xcb_change_property(dpy, XCB_PROP_MODE_APPEND, screen->root,
+				ewmh->_NET_CLIENT_LIST_STACKING, XCB_ATOM_WINDOW,
+				32, 1, &c->win);
+}
+
+/**
+ * @brief Rewrite _NET_CLIENT_LIST and _NET_CLIENT_LIST_STACKING, if clients
+ * have been removed or restacked since they were last written.
+ *
+ * This is called once for each batch of events, so many changes are
+ * collapsed into a single rewrite.
+ *
+ * In the stacking list, the clients of hidden workspaces are placed below
+ * those of the current workspace.
+ */
+static void ewmh_update_client_lists(void)
+{
+	xcb_window_t *wins;
+	unsigned int n = 0, i;
+	int cnt = 0;
+	Client *c;
+
+	if (!client_list_dirty && !stacking_dirty)
+		return;
+	for (i = 0; i < busy_cnt; i++)
+		cnt += wss[busy_ws[i]].client_cnt;
+	wins = malloc(sizeof(xcb_window_t) * (cnt > 0 ? cnt : 1));
+	if (!wins) {
+		log_err("Can't allocate memory for the client lists.");
+		return;
+	}
+	if (client_list_dirty) {
+		for (i = 0; i < busy_cnt; i++)
+			for (c = wss[busy_ws[i]].head; c; c = c->next)
+				wins[n++] = c->win;
+		xcb_ewmh_set_client_list(ewmh, 0, n, wins);
+		client_list_dirty = false;
+	}
+	if (stacking_dirty) {
+		n = 0;
+		for (i = 0; i < busy_cnt; i++)
+			if (!ws_visible(busy_ws[i]))
+				for (c = wss[busy_ws[i]].head; c; c = c->next)
+					wins[n++] = c->win;
+		for (i = 0; i < mon_cnt; i++)
+			if (mons[i].ws != cw)
+				n += stacking_order(mons[i].ws, wins + n);
+		n += stacking_order(cw, wins + n);
+		xcb_ewmh_set_client_list_stacking(ewmh, 0, n, wins);
+		stacking_dirty = false;
+	}
+	free(wins);
+}
+
 /**
  * @brief Set the fullscreen state of the client. Change its geometry and
  * border widths.
@@ -2353,38 +4719,98 @@ void setup_ewmh(void)
  */
 static void set_fullscreen(Client *c, bool fscr)
 {
-	long data[] = {fscr ? ewmh->_NET_WM_STATE_FULLSCREEN : XCB_NONE };
+	unsigned int group;
+	Monitor *m;
+	int ws;
 
 	if (!c || fscr == c->is_fullscreen)
 		return;
 
+	group = stacking_group(c);
 	c->is_fullscreen = fscr;
+	regroup_client(c, group);
 	log_info("Setting client <%p>'s fullscreen state to %d", c, fscr);
-	xcb_change_property(dpy, XCB_PROP_MODE_REPLACE,
-			c->win, ewmh->_NET_WM_STATE, XCB_ATOM_ATOM, 32,
-			fscr, data);
+	ewmh_set_wm_state(c);
+	ws = client_ws(c);
+	m = ws_output(ws);
+	if (fscr)
+		change_client_geom(c, m->x, m->y, m->w, m->h);
+	if (!ws_visible(ws)) {
+		wss[ws].dirty = true;
+		return;
+	}
 	if (fscr) {
 		set_border_width(c->win, 0);
-		change_client_geom(c, 0, 0, screen_width, screen_height);
-		draw_clients();
+		draw_clients(ws);
 	} else {
-		set_border_width(c->win, !wss[cw].head->next ? 0 : BORDER_PX);
-		arrange_windows();
-		draw_clients();
+		set_border_width(c->win, !wss[ws].head->next ? 0 : BORDER_PX);
+		arrange_ws(ws);
 	}
 }
 
+/**
+ * @brief Change whether a client is urgent, keeping the urgent queue and the
+ * workspace's urgent count up to date.
+ *
+ * @param c The client.
+ * @param urg Whether the client should be urgent.
+ */
 static void set_urgent(Client *c, bool urg)
 {
 	if (!c || urg == c->is_urgent)
 		return;
 
 	c->is_urgent = urg;
+	if (c->ws && urg) {
+		urgent_push(c);
+		wss[c->ws].urgent_cnt++;
+	} else if (c->ws) {
+		urgent_unlink(c);
+		wss[c->ws].urgent_cnt--;
+	}
+	howm_info();
+	/* Border colours are refreshed when a hidden workspace is shown. */
+	if (!ws_visible(client_ws(c)))
+		return;
 	xcb_change_window_attributes(dpy, c->win, XCB_CW_BORDER_PIXEL,
 			urg ? &border_urgent : c == wss[cw].current
 			? &border_focus : &border_unfocus);
 }
 
+/**
+ * @brief Add a client to the back of the urgent queue.
+ *
+ * @param c The client, which must be urgent and on a workspace.
+ */
+static void urgent_push(Client *c)
+{
+	c->urg_next = NULL;
+	c->urg_prev = urgent.tail;
+	if (urgent.tail)
+		urgent.tail->urg_next = c;
+	else
+		urgent.head = c;
+	urgent.tail = c;
+}
+
+/**
+ * @brief Take a client out of the urgent queue.
+ *
+ * @param c The client, which must be in the queue.
+ */
+static void urgent_unlink(Client *c)
+{
+	if (c->urg_prev)
+		c->urg_prev->urg_next = c->urg_next;
+	else
+		urgent.head = c->urg_next;
+	if (c->urg_next)
+		c->urg_next->urg_prev = c->urg_prev;
+	else
+		urgent.tail = c->urg_prev;
+	c->urg_next = c->urg_prev = NULL;
+}
+
 /**
  * @brief Toggle the fullscreen state of the current client.
  *
@@ -2406,6 +4832,7 @@ static void client_message_event(xcb_generic_event_t *ev)
 {
 	xcb_client_message_event_t *cm = (xcb_client_message_event_t *)ev;
 	Client *c = find_client_by_win(cm->window);
+	int ws;
 
 	if (c && cm->type == ewmh->_NET_WM_STATE) {
 		ewmh_process_wm_state(c, (xcb_atom_t) cm->data.data32[1], cm->data.data32[0]);
@@ -2413,11 +4840,20 @@ static void client_message_event(xcb_generic_event_t *ev)
 			ewmh_process_wm_state(c, (xcb_atom_t) cm->data.data32[2], cm->data.data32[0]);
 	} else if (c && cm->type == ewmh->_NET_CLOSE_WINDOW) {
 		log_info("_NET_CLOSE_WINDOW: Removing client <%p>", c);
+		ws = client_ws(c);
 		remove_client(c);
-		arrange_windows();
+		if (ws_visible(ws))
+			arrange_ws(ws);
+		else
+			wss[ws].dirty = true;
 	} else if (c && cm->type == ewmh->_NET_ACTIVE_WINDOW) {
 		log_info("_NET_ACTIVE_WINDOW: Focusing client <%p>", c);
 		update_focused_client(find_client_by_win(cm->window));
+	} else if (cm->type == ewmh->_NET_NUMBER_OF_DESKTOPS) {
+		log_info("_NET_NUMBER_OF_DESKTOPS: Asked for %u workspaces",
+				cm->data.data32[0]);
+		set_ws_count(cm->data.data32[0] > WORKSPACES_MAX ? WORKSPACES_MAX
+				: (int)cm->data.data32[0]);
 	} else {
 		log_debug("Unhandled client message.");
 	}
@@ -2437,6 +4873,7 @@ static void save_last_ocm(void (*op)(const unsigned int, int), const unsigned in
 	rep_state.last_type = type;
 	rep_state.last_cnt = cnt;
 	rep_state.last_cmd = NULL;
+	record_step(NULL, NULL, op, type, cnt);
 }
 
 /**
@@ -2451,21 +4888,188 @@ static void save_last_cmd(void (*cmd)(const Arg *arg), const Arg *arg)
 	rep_state.last_cmd = cmd;
 	rep_state.last_arg = arg;
 	rep_state.last_op = NULL;
+	if (cmd != play_macro)
+		record_step(cmd, arg, NULL, 0, 0);
 }
 
 /**
  * @brief Replay the last command or operator, complete with the last arguments
  * passed to them.
  *
+ * When a macro is being recorded, the step that is replayed is recorded, as
+ * replay itself is never saved.
+ *
  * @param arg Unused
  */
 static void replay(const Arg *arg)
 {
 	UNUSED(arg);
-	if (rep_state.last_cmd)
+	if (rep_state.last_cmd) {
+		if (rep_state.last_cmd != play_macro)
+			record_step(rep_state.last_cmd, rep_state.last_arg,
+					NULL, 0, 0);
 		rep_state.last_cmd(rep_state.last_arg);
-	else
+	} else if (rep_state.last_op) {
+		record_step(NULL, NULL, rep_state.last_op, rep_state.last_type,
+				rep_state.last_cnt);
 		rep_state.last_op(rep_state.last_type, rep_state.last_cnt);
+	}
+}
+
+/**
+ * @brief Start recording commands and operators into a macro register, or
+ * stop recording if a macro is already being recorded.
+ *
+ * @param arg arg->i is the register to record into.
+ */
+static void toggle_recording(const Arg *arg)
+{
+	if (recording >= 0) {
+		log_info("Recorded %u steps into register %d",
+				macros[recording].len, recording);
+		recording = -1;
+		return;
+	}
+	if (arg->i < 0 || arg->i >= MACRO_REGISTERS)
+		return;
+	log_info("Recording into register %d", arg->i);
+	recording = arg->i;
+	macros[recording].len = 0;
+}
+
+/**
+ * @brief Add a command or operator to the macro that is being recorded.
+ *
+ * @param cmd The command, or NULL if an operator is being recorded.
+ * @param arg The argument that was passed to cmd.
+ * @param op The operator, if cmd is NULL.
+ * @param type The type that op was called with.
+ * @param cnt The count that op was called with.
+ */
+static void record_step(void (*cmd)(const Arg *), const Arg *arg,
+		void (*op)(const unsigned int, int), unsigned int type, int cnt)
+{
+	struct macro *m;
+	struct macro_step *steps;
+
+	if (recording < 0)
+		return;
+	m = &macros[recording];
+	if (m->len == m->cap) {
+		steps = realloc(m->steps, sizeof(struct macro_step)
+				* (m->cap ? m->cap * 2 : 16));
+		if (!steps) {
+			log_warn("Can't allocate memory for the macro, stopping recording.");
+			recording = -1;
+			return;
+		}
+		m->steps = steps;
+		m->cap = m->cap ? m->cap * 2 : 16;
+	}
+	m->steps[m->len++] = (struct macro_step){ cmd, arg, op, type, cnt };
+}
+
+/**
+ * @brief Play the macro in a register, as many times as the count that was
+ * typed before it.
+ *
+ * The whole playback is one transaction, so the workspaces are only arranged,
+ * restacked and focused once at the end, and windows are only shown or hidden
+ * once, for the workspaces that end up on screen.
+ *
+ * @param arg arg->i is the register to play.
+ */
+static void play_macro(const Arg *arg)
+{
+	struct macro *m;
+	int times = macro_cnt ? macro_cnt : 1;
+	unsigned int i;
+
+	macro_cnt = 0;
+	if (arg->i < 0 || arg->i >= MACRO_REGISTERS || arg->i == recording)
+		return;
+	m = &macros[arg->i];
+	if (!m->len)
+		return;
+	log_info("Playing register %d %d times", arg->i, times);
+	txn_begin();
+	while (times-- > 0)
+		for (i = 0; i < m->len; i++) {
+			if (m->steps[i].cmd)
+				m->steps[i].cmd(m->steps[i].arg);
+			else
+				m->steps[i].op(m->steps[i].type, m->steps[i].cnt);
+		}
+	txn_commit();
+}
+
+/**
+ * @brief Open a transaction, putting off arranging, restacking, focusing,
+ * showing and hiding clients and printing the status until it is committed.
+ */
+static void txn_begin(void)
+{
+	if (txn.depth++ == 0)
+		txn.ws = cw;
+}
+
+/**
+ * @brief Close a transaction, doing the work that was put off whilst it was
+ * open.
+ *
+ * If clients were shown or hidden, every client is put on or off the screen
+ * to match the workspaces that are now shown, hiding before showing as
+ * change_ws() does. Workspaces that were arranged but have since been hidden
+ * are marked dirty, so that they are fixed up when they are next shown. If
+ * the transaction changed workspace, the new one is restacked and focused
+ * even if nothing asked for it, so that focus goes back to the root on an
+ * empty workspace.
+ */
+static void txn_commit(void)
+{
+	unsigned int i;
+	Client *c;
+	int w;
+
+	if (--txn.depth > 0)
+		return;
+	if (txn.show) {
+		for (i = 0; i < busy_cnt; i++) {
+			w = busy_ws[i];
+			if (!ws_visible(w))
+				for (c = wss[w].head; c; c = c->next)
+					hide_client(c);
+		}
+		for (i = 0; i < mon_cnt; i++) {
+			w = mons[i].ws;
+			apply_pending(w);
+			for (c = wss[w].head; c; c = c->next)
+				show_client(c);
+		}
+	}
+	for (i = 0; i < busy_cnt; i++) {
+		w = busy_ws[i];
+		if (!wss[w].arrange_pending)
+			continue;
+		wss[w].arrange_pending = false;
+		if (ws_visible(w))
+			arrange_ws(w);
+		else
+			wss[w].dirty = true;
+	}
+	if (txn.restack || cw != txn.ws)
+		restack_clients();
+	if (txn.focus || cw != txn.ws)
+		send_focus();
+	if (cw != txn.ws) {
+		xcb_ewmh_set_current_desktop(ewmh, 0, cw - 1);
+		update_workarea();
+		txn.info = true;
+	}
+	if (txn.info)
+		howm_info();
+	txn.restack = txn.focus = txn.info = txn.show = false;
+	xcb_flush(dpy);
 }
 
 /**
@@ -2512,248 +5116,856 @@ static void ewmh_process_wm_state(Client *c, xcb_atom_t a, int action)
 }
 
 /**
- * @brief Dynamically allocate space for the contents of the stack.
+ * @brief Set a client's _NET_WM_STATE to reflect the states that howm keeps
+ * track of.
  *
- * We don't know how big the stack will be when the struct is defined, so we
- * need to allocate it dynamically.
+ * @param c The client that should have its _NET_WM_STATE updated.
+ */
+static void ewmh_set_wm_state(Client *c)
+{
+	xcb_atom_t states[2];
+	uint32_t n = 0;
+
+	if (c->is_fullscreen)
+		states[n++] = ewmh->_NET_WM_STATE_FULLSCREEN;
+	if (c->is_parked)
+		states[n++] = ewmh->_NET_WM_STATE_HIDDEN;
+	xcb_ewmh_set_wm_state(ewmh, c->win, n, states);
+}
+
+/**
+ * @brief Allocate space for the segments of the delete register.
  *
- * @param s The stack that needs to have its contents allocated.
+ * @param r The delete register.
  */
-static void stack_init(struct stack *s)
+static void reg_init(struct cut_register *r)
 {
-	s->contents = (Client **)malloc(sizeof(Client) * DELETE_REGISTER_SIZE);
-	if (!s->contents)
-		log_err("Failed to allocate memory for stack.");
+	r->segs = malloc(sizeof(struct segment) * DELETE_REGISTER_SIZE);
+	r->evicted.head = r->evicted.tail = NULL;
+	r->evicted.cnt = 0;
+	if (!r->segs)
+		log_err("Failed to allocate memory for the delete register.");
 }
 
 /**
- * @brief Free the allocated contents.
+ * @brief Free the delete register's segments.
+ *
+ * The clients that are still in the register belong to the client pool, so
+ * they are freed along with it.
  *
- * @param s The stack that needs to have its contents freed.
+ * @param r The delete register.
  */
-static void stack_free(struct stack *s)
+static void reg_free(struct cut_register *r)
 {
-	free(s->contents);
+	free(r->segs);
 }
 
 /**
- * @brief Pushes a client onto the stack, as long as it isn't full.
+ * @brief Add a segment of cut clients to the delete register.
  *
- * @param s The stack.
- * @param c The client to be pushed on. This client is treated as the head of a
- * linked list.
+ * If the register is full, the oldest segment is evicted to make room.
+ *
+ * @param r The delete register.
+ * @param head The first client of the segment.
+ * @param tail The last client of the segment.
+ * @param cnt The amount of clients in the segment.
  */
-static void stack_push(struct stack *s, Client *c)
+static void reg_push(struct cut_register *r, Client *head, Client *tail,
+		unsigned int cnt)
 {
-	if (!c || !s) {
+	struct segment *seg;
+
+	if (!head)
 		return;
-	} else if (s->size >= DELETE_REGISTER_SIZE) {
-		log_warn("Can't push <%p> onto stack <%p>- it is full", c, s);
+	if (r->size == DELETE_REGISTER_SIZE)
+		reg_evict(r);
+	seg = &r->segs[(r->first + r->size++) % DELETE_REGISTER_SIZE];
+	seg->head = head;
+	seg->tail = tail;
+	seg->cnt = cnt;
+}
+
+/**
+ * @brief Remove the newest segment from the delete register.
+ *
+ * @param r The delete register.
+ * @param seg Where the segment should be stored.
+ *
+ * @return False if the register was empty.
+ */
+static bool reg_pop(struct cut_register *r, struct segment *seg)
+{
+	if (r->size == 0)
+		return false;
+	*seg = r->segs[(r->first + --r->size) % DELETE_REGISTER_SIZE];
+	return true;
+}
+
+/**
+ * @brief Push the oldest segment out of the delete register.
+ *
+ * The segment is only set aside here, as the cut that caused it may still be
+ * taking clients from the current workspace. reg_close_evicted() closes it.
+ *
+ * @param r The delete register.
+ */
+static void reg_evict(struct cut_register *r)
+{
+	struct segment *seg = &r->segs[r->first];
+
+	log_warn("Delete register is full, closing %u clients that were cut "
+			"earliest", seg->cnt);
+	if (r->evicted.head) {
+		r->evicted.tail->next = seg->head;
+		seg->head->prev = r->evicted.tail;
+	} else {
+		r->evicted.head = seg->head;
+	}
+	r->evicted.tail = seg->tail;
+	r->evicted.cnt += seg->cnt;
+	r->first = (r->first + 1) % DELETE_REGISTER_SIZE;
+	r->size--;
+}
+
+/**
+ * @brief Close the clients that were pushed out of the delete register.
+ *
+ * They are put back at the end of the current workspace before being asked
+ * to close, so they stay managed until their DestroyNotify arrives. A window
+ * that won't close, such as one asking whether to save, is left where the
+ * user can see it.
+ *
+ * @param r The delete register.
+ */
+static void reg_close_evicted(struct cut_register *r)
+{
+	struct segment seg = r->evicted;
+	Client *c;
+
+	if (!seg.head)
 		return;
+	r->evicted.head = r->evicted.tail = NULL;
+	r->evicted.cnt = 0;
+	restore_run(cw, wss[cw].tail, &seg);
+	if (!wss[cw].current)
+		wss[cw].current = seg.head;
+	for (c = seg.head; c; c = c == seg.tail ? NULL : c->next)
+		close_win(c->win);
+	client_list_dirty = stacking_dirty = true;
+	update_focused_client(wss[cw].current);
+}
+
+/**
+ * @brief Find a window's client amongst the clients held by the delete
+ * register.
+ *
+ * @param r The delete register.
+ * @param win The window to look for.
+ * @param cp Where the client is stored, if it is found.
+ *
+ * @return The segment holding the client, or NULL if the window isn't in the
+ * register.
+ */
+static struct segment *reg_find(struct cut_register *r, xcb_window_t win,
+		Client **cp)
+{
+	struct segment *seg = &r->evicted;
+	unsigned int i = 0;
+	Client *c;
+
+	for (;;) {
+		for (c = seg->head; c; c = c == seg->tail ? NULL : c->next) {
+			if (c->win == win) {
+				*cp = c;
+				return seg;
+			}
+		}
+		if (i == r->size)
+			return NULL;
+		seg = &r->segs[(r->first + i++) % DELETE_REGISTER_SIZE];
 	}
-	s->contents[++(s->size)] = c;
 }
 
 /**
- * @brief Remove the top item from the stack and return it.
+ * @brief Take a client whose window has gone out of the delete register and
+ * give it back to the pool.
  *
- * @param s The stack to be popped from.
+ * A segment left empty is dropped, so that pasting never restores nothing.
  *
- * @return The client that was at the top of the stack. It acts as the head of
- * the linked list of clients.
+ * @param r The delete register.
+ * @param seg The segment holding c, as returned by reg_find().
+ * @param c The client.
  */
-static Client *stack_pop(struct stack *s)
+static void reg_forget(struct cut_register *r, struct segment *seg, Client *c)
 {
-	if (!s) {
-		return NULL;
-	} else if (s->size == 0) {
-		log_warn("Can't pop from stack <%p> as it is empty.", s);
-		return NULL;
+	unsigned int i;
+
+	log_info("Client <%p> went away whilst in the delete register", c);
+	if (c == seg->head && c == seg->tail) {
+		seg->head = seg->tail = NULL;
+	} else if (c == seg->head) {
+		seg->head = c->next;
+		seg->head->prev = NULL;
+	} else if (c == seg->tail) {
+		seg->tail = c->prev;
+		seg->tail->next = NULL;
+	} else {
+		c->prev->next = c->next;
+		c->next->prev = c->prev;
+	}
+	seg->cnt--;
+	client_release(&clients, c);
+	if (seg->head || seg == &r->evicted)
+		return;
+	/* Close the gap, keeping the segments in the order they were cut. */
+	i = (seg - r->segs + DELETE_REGISTER_SIZE - r->first)
+		% DELETE_REGISTER_SIZE;
+	for (; i + 1 < r->size; i++)
+		r->segs[(r->first + i) % DELETE_REGISTER_SIZE] =
+			r->segs[(r->first + i + 1) % DELETE_REGISTER_SIZE];
+	r->size--;
+}
+
+/**
+ * @brief Take an unused client from the pool.
+ *
+ * A new slab is allocated when the free list is empty.
+ *
+ * @param cp The client pool.
+ *
+ * @return A zeroed client, with only its id set.
+ */
+static Client *client_alloc(struct client_pool *cp)
+{
+	Client **slabs, *slab, *c;
+	uint32_t id;
+	int i;
+
+	if (!cp->free_list) {
+		slabs = realloc(cp->slabs, sizeof(Client *) * (cp->slab_cnt + 1));
+		slab = calloc(CLIENT_SLAB_SIZE, sizeof(Client));
+		if (!slabs || !slab) {
+			log_err("Can't allocate memory for client.");
+			exit(EXIT_FAILURE);
+		}
+		cp->slabs = slabs;
+		cp->slabs[cp->slab_cnt] = slab;
+		/* Push in reverse so that the slab is handed out in order. */
+		for (i = CLIENT_SLAB_SIZE - 1; i >= 0; i--) {
+			slab[i].id = cp->slab_cnt * CLIENT_SLAB_SIZE + i;
+			slab[i].next = cp->free_list;
+			cp->free_list = &slab[i];
+		}
+		cp->slab_cnt++;
+	}
+	c = cp->free_list;
+	cp->free_list = c->next;
+	id = c->id;
+	memset(c, 0, sizeof(Client));
+	c->id = id;
+	return c;
+}
+
+/**
+ * @brief Give a client back to the pool, so that it can be reused.
+ *
+ * @param cp The client pool.
+ * @param c The client, which must not be in any list.
+ */
+static void client_release(struct client_pool *cp, Client *c)
+{
+	free_props(c->props);
+	c->next = cp->free_list;
+	cp->free_list = c;
+}
+
+/**
+ * @brief Find a client by its index in the pool.
+ *
+ * @param cp The client pool.
+ * @param id The client's index.
+ *
+ * @return The client.
+ */
+static Client *client_by_id(const struct client_pool *cp, uint32_t id)
+{
+	return &cp->slabs[id / CLIENT_SLAB_SIZE][id % CLIENT_SLAB_SIZE];
+}
+
+/**
+ * @brief Free every slab in the pool.
+ *
+ * @param cp The client pool.
+ */
+static void client_pool_free(struct client_pool *cp)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < cp->slab_cnt; i++) {
+		for (j = 0; j < CLIENT_SLAB_SIZE; j++)
+			free_props(cp->slabs[i][j].props);
+		free(cp->slabs[i]);
+	}
+	free(cp->slabs);
+	cp->slabs = NULL;
+	cp->slab_cnt = 0;
+	cp->free_list = NULL;
+}
+
+/**
+ * @brief Allocate the slots of a window index.
+ *
+ * @param wi The window index to be set up.
+ * @param cap The amount of slots, which must be a power of two.
+ */
+static void win_index_init(struct win_index *wi, unsigned int cap)
+{
+	wi->slots = calloc(cap, sizeof(struct win_slot));
+	if (!wi->slots) {
+		log_err("Failed to allocate memory for the window index.");
+		exit(EXIT_FAILURE);
+	}
+	wi->cap = cap;
+	wi->cnt = 0;
+	for (wi->shift = 32; cap > 1; cap >>= 1)
+		wi->shift--;
+}
+
+/**
+ * @brief Work out which slot a window should be stored in, if there are no
+ * collisions.
+ *
+ * Window IDs are mostly sequential, so Fibonacci hashing is used to spread
+ * them across the table.
+ *
+ * @param wi The window index.
+ * @param win The window to be hashed.
+ *
+ * @return The window's home slot.
+ */
+static unsigned int win_index_slot(const struct win_index *wi, xcb_window_t win)
+{
+	return wi->shift >= 32 ? 0 : (uint32_t)(win * 2654435769u) >> wi->shift;
+}
+
+/**
+ * @brief Find the client that is stored in a slot of a window index.
+ *
+ * @param wi The window index.
+ * @param i The slot, which must not be empty.
+ *
+ * @return The client in slot i.
+ */
+static Client *win_index_at(const struct win_index *wi, unsigned int i)
+{
+	return client_by_id(&clients, wi->slots[i].id - 1);
+}
+
+/**
+ * @brief Add a client to a window index, or replace the client that its
+ * window was mapped to.
+ *
+ * The index is doubled in size when it becomes half full.
+ *
+ * @param wi The window index.
+ * @param c The client to be added.
+ */
+static void win_index_put(struct win_index *wi, Client *c)
+{
+	struct win_index bigger;
+	unsigned int i, mask = wi->cap - 1;
+
+	if ((wi->cnt + 1) * 2 > wi->cap) {
+		win_index_init(&bigger, wi->cap * 2);
+		for (i = 0; i < wi->cap; i++)
+			if (wi->slots[i].id)
+				win_index_put(&bigger, win_index_at(wi, i));
+		free(wi->slots);
+		*wi = bigger;
+		mask = wi->cap - 1;
+	}
+	for (i = win_index_slot(wi, c->win); wi->slots[i].id; i = (i + 1) & mask)
+		if (wi->slots[i].win == c->win)
+			break;
+	if (!wi->slots[i].id)
+		wi->cnt++;
+	wi->slots[i].win = c->win;
+	wi->slots[i].id = c->id + 1;
+}
+
+/**
+ * @brief Remove a window from a window index.
+ *
+ * The entries that follow it are moved back, so that none of them become
+ * unreachable from their home slot.
+ *
+ * @param wi The window index.
+ * @param win The window to be removed.
+ */
+static void win_index_del(struct win_index *wi, xcb_window_t win)
+{
+	unsigned int i, j, k, mask = wi->cap - 1;
+
+	for (i = win_index_slot(wi, win); wi->slots[i].id; i = (i + 1) & mask)
+		if (wi->slots[i].win == win)
+			break;
+	if (!wi->slots[i].id)
+		return;
+	wi->slots[i].id = 0;
+	wi->cnt--;
+	for (j = (i + 1) & mask; wi->slots[j].id; j = (j + 1) & mask) {
+		k = win_index_slot(wi, wi->slots[j].win);
+		/* Only move the entry if its home slot isn't between the hole
+		 * and where it is now. */
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			wi->slots[i] = wi->slots[j];
+			wi->slots[j].id = 0;
+			i = j;
+		}
 	}
-	return s->contents[(s->size)--];
 }
 
 /**
- * @brief Cut one or more clients and add them onto howm's delete register
- * stack (if there is space).
+ * @brief Look up the client that a window belongs to.
+ *
+ * @param wi The window index.
+ * @param win The window to search for.
+ *
+ * @return The client, or NULL if the window isn't in the index.
+ */
+static Client *win_index_get(const struct win_index *wi, xcb_window_t win)
+{
+	unsigned int i, mask = wi->cap - 1;
+
+	for (i = win_index_slot(wi, win); wi->slots[i].id; i = (i + 1) & mask)
+		if (wi->slots[i].win == win)
+			return win_index_at(wi, i);
+	return NULL;
+}
+
+/**
+ * @brief Cut one or more clients and add them onto howm's delete register.
  *
- * A segment of howm's internal client list is taken and placed onto the delete
- * register stack. All clients from the list segment must be unmapped and the
- * remaining clients must be refocused.
+ * A segment of howm's internal client list is spliced out and placed into the
+ * delete register, evicting the oldest segment if the register is full. All
+ * clients from the list segment must be unmapped and the remaining clients
+ * must be refocused.
  *
  * @param type Whether to cut an entire workspace or client.
  * @param cnt The amount of clients or workspaces to cut.
  */
 static void op_cut(const unsigned int type, int cnt)
 {
-	Client *tail = wss[cw].current;
 	Client *head = wss[cw].current;
-	Client *head_prev = prev_client(wss[cw].current, cw);
-	bool wrap = false;
+	Client *c, *n, *tail = NULL, *first, *last;
+	bool wrapped = false;
+	int w, taken;
 
 	if (!head)
 		return;
 
-	if (del_reg.size >= DELETE_REGISTER_SIZE) {
-		log_warn("No more stack space.");
-		return;
-	}
-
-	if ((type == CLIENT && cnt >= wss[cw].client_cnt) || type == WORKSPACE) {
-		if (cnt + del_reg.size > DELETE_REGISTER_SIZE)
-			return;
-
+	if (type == WORKSPACE || cnt >= wss[cw].client_cnt) {
+		/* Cutting every client of a workspace cuts the workspace. Each
+		 * workspace's list goes into the register as it is. */
+		if (type == CLIENT)
+			cnt = 1;
+		/* Pushing more segments than the register holds would evict
+		 * the start of this very cut. */
+		if (cnt > DELETE_REGISTER_SIZE) {
+			log_warn("Can only cut %d workspaces at once",
+					DELETE_REGISTER_SIZE);
+			cnt = DELETE_REGISTER_SIZE;
+		}
 		while (cnt > 0) {
-			head = wss[correct_ws(cw + cnt - 1)].head;
-			for (tail = head; tail; tail = tail->next)
-				xcb_unmap_window(dpy, tail->win);
-			stack_push(&del_reg, head);
-			wss[correct_ws(cw + cnt - 1)].head = NULL;
-			wss[correct_ws(cw + cnt - 1)].prev_foc = NULL;
-			wss[correct_ws(cw + cnt - 1)].current = NULL;
+			w = correct_ws(cw + cnt - 1);
+			for (c = wss[w].head; c; c = c->next) {
+				mru_del(w, c);
+				forget_scratchpad(c);
+				if (c->is_urgent)
+					urgent_unlink(c);
+				unmap_client(c);
+				win_index_del(&clients_by_win, c->win);
+				c->ws = 0;
+			}
+			reg_push(&del_reg, wss[w].head, wss[w].tail,
+					wss[w].client_cnt);
+			wss[w].head = wss[w].tail = NULL;
+			wss[w].current = NULL;
+			wss[w].client_cnt = 0;
+			memset(wss[w].group_cnt, 0, sizeof(wss[w].group_cnt));
+			wss[w].urgent_cnt = 0;
+			wss[w].part_dirty = true;
+			update_busy(w);
 			cnt--;
-			wss[correct_ws(cw + cnt - 1)].client_cnt = 0;
 		}
+		client_list_dirty = stacking_dirty = true;
+		reg_close_evicted(&del_reg);
 
 	} else if (type == CLIENT) {
-		xcb_unmap_window(dpy, head->win);
-		wss[cw].client_cnt--;
-		while (cnt > 1) {
-			if (!tail->next && next_client(tail)) {
-				wrap = true;
-				/* Join the list into a circular linked list,
-				 * just for now so that we don't miss any
-				 * clients. */
-				tail->next = next_client(tail);
-			}
-			if (tail == wss[cw].prev_foc)
-				wss[cw].prev_foc = NULL;
-			tail = next_client(tail);
-			xcb_unmap_window(dpy, tail->win);
-			cnt--;
+		/* Take cnt clients, wrapping around the end of the list. The
+		 * links are left alone until every client has been visited. */
+		for (c = head, taken = 0; taken < cnt; taken++, c = n) {
+			n = next_client(c);
+			mru_del(cw, c);
+			forget_scratchpad(c);
+			if (c->is_urgent)
+				urgent_unlink(c);
+			unmap_client(c);
+			win_index_del(&clients_by_win, c->win);
+			c->ws = 0;
+			wss[cw].group_cnt[stacking_group(c)]--;
+			wss[cw].urgent_cnt -= c->is_urgent;
 			wss[cw].client_cnt--;
+			if (c == wss[cw].tail && taken + 1 < cnt)
+				wrapped = true;
+			tail = c;
 		}
 
-		if (head == wss[cw].head) {
-			wss[cw].head = head == next_client(tail) ? NULL : next_client(tail);
-		} else if (wrap) {
-			wss[cw].head = tail->next;
-			head_prev->next = NULL;
-		} else if (tail->next != head_prev) {
-			head_prev->next = wrap ? NULL : tail->next;
+		if (wrapped) {
+			/* The run is split across the end of the list, so it
+			 * is spliced out in two halves that are then joined. */
+			first = wss[cw].head;
+			last = wss[cw].tail;
+			detach_run(cw, head, last);
+			detach_run(cw, first, tail);
+			last->next = first;
+			first->prev = last;
+		} else {
+			detach_run(cw, head, tail);
 		}
 
-		wss[cw].current = head_prev;
-		tail->next = NULL;
-		update_focused_client(head_prev);
-		stack_push(&del_reg, head);
+		wss[cw].current = mru_refill(cw);
+		client_list_dirty = stacking_dirty = true;
+		update_focused_client(wss[cw].current);
+		reg_push(&del_reg, head, tail, cnt);
+		reg_close_evicted(&del_reg);
 	}
 }
 
 /**
- * @brief Focus a client that has an urgent hint.
+ * @brief Focus the client that has been urgent for longest, and clear its
+ * urgency.
  *
  * @param arg Unused.
  */
 static void focus_urgent(const Arg *arg)
 {
 	UNUSED(arg);
-	Client *c;
-	int w;
+	Client *c = urgent.head;
 
-	for (w = 1; w <= WORKSPACES; w++)
-		for (c = wss[w].head; c && !c->is_urgent; c = c->next)
-			;
-	if (c) {
-		log_info("Focusing urgent client <%p> on workspace <%d>", c, w);
-		change_ws(&(Arg){.i = w});
-		update_focused_client(c);
-	}
+	if (!c)
+		return;
+	log_info("Focusing urgent client <%p> on workspace <%d>", c, c->ws);
+	set_urgent(c, false);
+	change_ws(&(Arg){.i = c->ws});
+	update_focused_client(c);
 }
 
 /**
- * @brief Remove a list of clients from howm's delete register stack and paste
- * them after the currently focused window.
+ * @brief Remove the newest segment from howm's delete register and paste it
+ * after the currently focused window.
  *
  * @param arg Unused
  */
 static void paste(const Arg *arg)
 {
 	UNUSED(arg);
-	Client *head = stack_pop(&del_reg);
-	Client *t, *c = head;
+	struct segment seg;
 
-	if (!head) {
-		log_warn("No clients on stack.");
+	if (!reg_pop(&del_reg, &seg)) {
+		log_warn("No clients in the delete register.");
 		return;
 	}
 
-	if (!wss[cw].current) {
-		wss[cw].head = head;
-		wss[cw].current = head;
-		while (c) {
-			xcb_map_window(dpy, c->win);
-			wss[cw].current = c;
-			c = c->next;
-			wss[cw].client_cnt++;
+	restore_run(cw, wss[cw].current, &seg);
+	wss[cw].current = seg.tail;
+	client_list_dirty = stacking_dirty = true;
+	update_focused_client(wss[cw].current);
+}
+
+/**
+ * @brief Put a segment that was cut back onto a workspace and map its
+ * clients.
+ *
+ * @param ws The workspace, which must be visible.
+ * @param after The client that the segment should be placed after.
+ * @param seg The segment.
+ */
+static void restore_run(int ws, Client *after, const struct segment *seg)
+{
+	Client *c;
+
+	attach_run(ws, after, seg->head, seg->tail);
+	wss[ws].client_cnt += seg->cnt;
+	/* Any UnmapNotify events caused by cutting the clients have been
+	 * counted off whilst they were in the register. */
+	for (c = seg->head; c; c = c == seg->tail ? NULL : c->next) {
+		c->unmaps_expected = 0;
+		c->ws = ws;
+		win_index_put(&clients_by_win, c);
+		wss[ws].group_cnt[stacking_group(c)]++;
+		mru_add(ws, c);
+		if (c->is_urgent) {
+			urgent_push(c);
+			wss[ws].urgent_cnt++;
+		}
+		map_client(c);
+	}
+}
+
+/**
+ * @brief Find the first rule in the config file that matches a window.
+ *
+ * Each property is run through the compiled rules once, so the time taken
+ * doesn't depend on how many rules there are.
+ *
+ * @param props The window's properties.
+ *
+ * @return The matching rule, or NULL if no rule matches.
+ */
+static const Rule *find_rule(char * const *props)
+{
+	unsigned int p, st, best = LENGTH(rules);
+	const unsigned char *t;
+
+	for (p = 0; p < END_PROP && best > 0; p++) {
+		if (!props[p])
+			continue;
+		st = 0;
+		if (matcher.first[p] < best)
+			best = matcher.first[p];
+		for (t = (const unsigned char *)props[p]; *t && best > 0; t++) {
+			st = matcher.next[st * matcher.nsyms + matcher.sym[*t]];
+			if (matcher.first[st * END_PROP + p] < best)
+				best = matcher.first[st * END_PROP + p];
+		}
+	}
+	return best < LENGTH(rules) ? &rules[best] : NULL;
+}
+
+/**
+ * @brief Compile the rules in the config file into an Aho-Corasick
+ * automaton.
+ *
+ * A trie of the rules' strings is built first. Its states are then visited
+ * breadth first, so that each state's failure state is complete before the
+ * state itself. Every missing transition is filled in from the failure state,
+ * along with the rules that the failure state matches, leaving a DFA.
+ *
+ * @param rm The matcher to build.
+ */
+static void build_matcher(struct rule_matcher *rm)
+{
+	unsigned int i, p, c, st, u, max = 1, head = 0, tail = 0;
+	unsigned int *fail, *queue;
+	const unsigned char *t;
+
+	memset(rm->sym, 0, sizeof(rm->sym));
+	rm->nsyms = 1;
+	for (i = 0; i < LENGTH(rules); i++)
+		for (t = (const unsigned char *)rules[i].class; *t; t++, max++)
+			if (!rm->sym[*t])
+				rm->sym[*t] = rm->nsyms++;
+
+	rm->next = calloc(max * rm->nsyms, sizeof(unsigned int));
+	rm->first = malloc(sizeof(unsigned int) * max * END_PROP);
+	fail = malloc(sizeof(unsigned int) * max);
+	queue = malloc(sizeof(unsigned int) * max);
+	if (!rm->next || !rm->first || !fail || !queue) {
+		log_err("Failed to allocate memory for the rule matcher.");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < max * END_PROP; i++)
+		rm->first[i] = LENGTH(rules);
+
+	rm->nstates = 1;
+	for (i = 0; i < LENGTH(rules); i++) {
+		st = 0;
+		for (t = (const unsigned char *)rules[i].class; *t; t++) {
+			c = rm->sym[*t];
+			if (!rm->next[st * rm->nsyms + c])
+				rm->next[st * rm->nsyms + c] = rm->nstates++;
+			st = rm->next[st * rm->nsyms + c];
 		}
-	} else if (!wss[cw].current->next) {
-		wss[cw].current->next = head;
-		while (c) {
-			xcb_map_window(dpy, c->win);
-			wss[cw].current = c;
-			c = c->next;
-			wss[cw].client_cnt++;
+		for (p = 0; p < END_PROP; p++) {
+			if (rules[i].key == MATCH_NAME ? p > PROP_CLASS
+					: p != (unsigned int)rules[i].key - 1)
+				continue;
+			if (rm->first[st * END_PROP + p] > i)
+				rm->first[st * END_PROP + p] = i;
 		}
-	} else {
-		t = wss[cw].current->next;
-		wss[cw].current->next = head;
-		while (c) {
-			xcb_map_window(dpy, c->win);
-			wss[cw].client_cnt++;
-			if (!c->next) {
-				c->next = t;
-				wss[cw].current = c;
-				break;
+	}
+
+	/* The root's missing transitions are already 0, back to itself. */
+	for (c = 0; c < rm->nsyms; c++) {
+		u = rm->next[c];
+		if (u) {
+			fail[u] = 0;
+			queue[tail++] = u;
+		}
+	}
+	while (head < tail) {
+		st = queue[head++];
+		for (p = 0; p < END_PROP; p++)
+			if (rm->first[fail[st] * END_PROP + p] < rm->first[st * END_PROP + p])
+				rm->first[st * END_PROP + p] = rm->first[fail[st] * END_PROP + p];
+		for (c = 0; c < rm->nsyms; c++) {
+			u = rm->next[st * rm->nsyms + c];
+			if (u) {
+				fail[u] = rm->next[fail[st] * rm->nsyms + c];
+				queue[tail++] = u;
 			} else {
-				wss[cw].current = c;
-				c = c->next;
+				rm->next[st * rm->nsyms + c] = rm->next[fail[st] * rm->nsyms + c];
 			}
 		}
 	}
-	xcb_flush(dpy);
-	update_focused_client(wss[cw].current);
+	free(fail);
+	free(queue);
+	log_info("Compiled %u rules into %u states", LENGTH(rules), rm->nstates);
+}
+
+/**
+ * @brief Free the memory used by a rule matcher.
+ *
+ * @param rm The matcher.
+ */
+static void free_matcher(struct rule_matcher *rm)
+{
+	free(rm->next);
+	free(rm->first);
+	rm->next = rm->first = NULL;
+}
+
+/**
+ * @brief Copy a property's value into a NUL terminated string.
+ *
+ * @param s The value, which needn't be NUL terminated.
+ * @param len The length of the value.
+ *
+ * @return The copy, or NULL if it couldn't be allocated.
+ */
+static char *copy_prop(const char *s, unsigned int len)
+{
+	char *d = malloc(len + 1);
+
+	if (!d)
+		return NULL;
+	memcpy(d, s, len);
+	d[len] = '\0';
+	return d;
+}
+
+/**
+ * @brief Fetch the properties of a window that rules can match against.
+ *
+ * Only the properties whose bits are set in which are fetched, and their old
+ * values are freed. All of the requests are sent before waiting for any
+ * replies, so that only one round trip is made. _NET_WM_NAME is preferred over
+ * WM_NAME for the title.
+ *
+ * @param win The window.
+ * @param props Where to store the properties, indexed by enum client_props.
+ * @param which A mask with bit p set for each property p to be fetched.
+ */
+static void fetch_props(xcb_window_t win, char **props, unsigned int which)
+{
+	xcb_get_property_cookie_t wc_c, nn_c, wn_c, role_c;
+	xcb_icccm_get_wm_class_reply_t wc;
+	xcb_ewmh_get_utf8_strings_reply_t nn;
+	xcb_icccm_get_text_property_reply_t wn;
+	xcb_get_property_reply_t *role;
+	unsigned int p;
+
+	for (p = 0; p < END_PROP; p++) {
+		if (which & 1 << p) {
+			free(props[p]);
+			props[p] = NULL;
+		}
+	}
+	if (which & (1 << PROP_INSTANCE | 1 << PROP_CLASS))
+		wc_c = xcb_icccm_get_wm_class_unchecked(dpy, win);
+	if (which & 1 << PROP_TITLE) {
+		nn_c = xcb_ewmh_get_wm_name_unchecked(ewmh, win);
+		wn_c = xcb_icccm_get_wm_name_unchecked(dpy, win);
+	}
+	if (which & 1 << PROP_ROLE)
+		role_c = xcb_get_property_unchecked(dpy, 0, win,
+				wm_atoms[WM_WINDOW_ROLE], XCB_ATOM_STRING, 0,
+				UINT32_MAX);
+
+	if (which & (1 << PROP_INSTANCE | 1 << PROP_CLASS)
+			&& xcb_icccm_get_wm_class_reply(dpy, wc_c, &wc, NULL)) {
+		props[PROP_INSTANCE] = copy_prop(wc.instance_name,
+				strlen(wc.instance_name));
+		props[PROP_CLASS] = copy_prop(wc.class_name, strlen(wc.class_name));
+		xcb_icccm_get_wm_class_reply_wipe(&wc);
+	}
+	if (which & 1 << PROP_TITLE) {
+		if (xcb_ewmh_get_wm_name_reply(ewmh, nn_c, &nn, NULL)) {
+			props[PROP_TITLE] = copy_prop(nn.strings, nn.strings_len);
+			xcb_ewmh_get_utf8_strings_reply_wipe(&nn);
+		}
+		if (xcb_icccm_get_wm_name_reply(dpy, wn_c, &wn, NULL)) {
+			if (!props[PROP_TITLE])
+				props[PROP_TITLE] = copy_prop(wn.name, wn.name_len);
+			xcb_icccm_get_text_property_reply_wipe(&wn);
+		}
+	}
+	if (which & 1 << PROP_ROLE) {
+		role = xcb_get_property_reply(dpy, role_c, NULL);
+		if (role) {
+			if (role->format == 8 && xcb_get_property_value_length(role) > 0)
+				props[PROP_ROLE] = copy_prop(xcb_get_property_value(role),
+						xcb_get_property_value_length(role));
+			free(role);
+		}
+	}
+}
+
+/**
+ * @brief Free a client's cached properties.
+ *
+ * @param props The properties, which are set to NULL.
+ */
+static void free_props(char **props)
+{
+	unsigned int i;
+
+	for (i = 0; i < END_PROP; i++) {
+		free(props[i]);
+		props[i] = NULL;
+	}
 }
 
 /**
  * @brief Set the properties of a client that has just been created,
  * according to the rules defined in the config file.
  *
+ * The client hasn't been mapped yet, so only its state in memory is changed.
+ *
  * @param c The client that has been created.
+ * @param r The rule that matched the client, or NULL.
  */
-static void apply_rules(Client *c)
+static void apply_rules(Client *c, const Rule *r)
 {
-	xcb_icccm_get_wm_class_reply_t wc;
-	unsigned int i;
+	unsigned int group;
+	Monitor *m;
 
-	if (xcb_icccm_get_wm_class_reply(dpy, xcb_icccm_get_wm_class(dpy,
-					c->win), &wc, NULL)) {
-		for (i = 0; i < LENGTH(rules); i++) {
-			if (strstr(wc.instance_name, rules[i].class)
-					|| strstr(wc.class_name, rules[i].class)) {
-				c->is_floating = rules[i].is_floating;
-				c->is_fullscreen = rules[i].is_fullscreen;
-				client_to_ws(c, rules[i].ws == 0 ? cw
-						: rules[i].ws, rules[i].follow);
-				break;
-			}
-		}
+	if (!r)
+		return;
+	group = stacking_group(c);
+	c->is_floating = r->is_floating;
+	c->is_fullscreen = r->is_fullscreen;
+	regroup_client(c, group);
+	if (c->is_fullscreen) {
+		m = ws_output(client_ws(c));
+		change_client_geom(c, m->x, m->y, m->w, m->h);
+		ewmh_set_wm_state(c);
 	}
-	xcb_icccm_get_wm_class_reply_wipe(&wc);
 }
 
 /**
- * @brief Send a client to the scratchpad and unmap it.
+ * @brief Send a client to the scratchpad, parking it off-screen.
  *
  * @param arg Unused.
  */
@@ -2762,27 +5974,13 @@ void send_to_scratchpad(const Arg *arg)
 	UNUSED(arg);
 	Client *c = wss[cw].current;
 
-	if (scratchpad || !c)
+	if (scratchpad || !c || c->scratch_id)
 		return;
 
 	log_info("Sending client <%p> to scratchpad", c);
-	if (prev_client(c, cw))
-		prev_client(c, cw)->next = c->next;
-
-	/* TODO: This should be in a reusable function. */
-	if (c == wss[cw].prev_foc)
-		wss[cw].prev_foc = prev_client(wss[cw].current, cw);
-	if (c == wss[cw].current || !wss[cw].head->next)
-		wss[cw].current = wss[cw].prev_foc ? wss[cw].prev_foc : wss[cw].head;
-	if (c == wss[cw].head) {
-		wss[cw].head = c->next;
-		wss[cw].current = c->next;
-	}
-
-	xcb_unmap_window(dpy, c->win);
-	wss[cw].client_cnt--;
-	update_focused_client(wss[cw].current);
+	stow_client(c);
 	scratchpad = c;
+	update_focused_client(wss[cw].current);
 }
 
 /**
@@ -2793,31 +5991,207 @@ void send_to_scratchpad(const Arg *arg)
  */
 void get_from_scratchpad(const Arg *arg)
 {
+	Client *c = scratchpad;
+
 	UNUSED(arg);
-	if (!scratchpad)
+	if (!c)
 		return;
+	scratchpad = NULL;
+	unstow_client(c, SCRATCHPAD_WIDTH, SCRATCHPAD_HEIGHT);
+}
 
-	/* TODO: This should be in a reusable function. */
-	if (!wss[cw].head)
-		wss[cw].head = scratchpad;
-	else if (!wss[cw].head->next)
-		wss[cw].head->next = scratchpad;
-	else
-		prev_client(wss[cw].head, cw)->next = scratchpad;
+/**
+ * @brief Show or hide a named scratchpad.
+ *
+ * The scratchpad's command is run the first time it is asked for. If its
+ * window still hasn't appeared when it is asked for again (the command may
+ * have failed, or its WM_CLASS may not contain the name) the command is run
+ * again. After that its window stays mapped: hiding it parks it off-screen,
+ * and showing it only needs it to be moved back and restacked. A scratchpad
+ * that is on another workspace is brought to the current one.
+ *
+ * @param arg arg->i is the index of the scratchpad in scratchpads.
+ */
+static void toggle_scratchpad(const Arg *arg)
+{
+	const Scratchpad *sp;
+	Client *c;
 
+	if (arg->i < 0 || (unsigned int)arg->i >= LENGTH(scratchpads))
+		return;
+	sp = &scratchpads[arg->i];
+	c = scratch[arg->i].c;
 
-	wss[cw].prev_foc = wss[cw].current;
-	wss[cw].current = scratchpad;
+	if (!c) {
+		if (scratch[arg->i].spawning)
+			log_warn("Scratchpad <%s> hasn't appeared, starting it again", sp->name);
+		else
+			log_info("Starting scratchpad <%s>", sp->name);
+		scratch[arg->i].spawning = true;
+		spawn(&(Arg){ .cmd = sp->cmd });
+		return;
+	}
 
-	scratchpad = NULL;
+	if (c->ws) {
+		log_info("Hiding scratchpad <%s>", sp->name);
+		if (c->ws == cw) {
+			stow_client(c);
+			update_focused_client(wss[cw].current);
+			return;
+		}
+		stow_client(c);
+	}
+	log_info("Showing scratchpad <%s>", sp->name);
+	unstow_client(c, sp->w, sp->h);
+}
+
+/**
+ * @brief Take a client off of its workspace and park its window off-screen.
+ *
+ * The window stays mapped, so that it can be shown again without being
+ * redrawn. It is also taken out of the window index, so the usual event
+ * handlers leave it alone. destroy_event() and unmap_event() find it through
+ * stowed_slot() instead.
+ *
+ * @param c The client to be stowed.
+ */
+static void stow_client(Client *c)
+{
+	int ws = c->ws;
+
+	detach_client(ws, c);
+	mru_del(ws, c);
+	if (c == wss[ws].current)
+		wss[ws].current = mru_refill(ws);
+	if (c->is_urgent)
+		urgent_unlink(c);
+	win_index_del(&clients_by_win, c->win);
+	c->ws = 0;
+	wss[ws].client_cnt--;
+
+	park_client(c);
+	/* Windows on hidden workspaces are unmapped unless they are parked. */
+	if (!PARK_WORKSPACES && !ws_visible(ws))
+		map_client(c);
+	if (ws_visible(ws))
+		arrange_ws(ws);
+	client_list_dirty = stacking_dirty = true;
+}
+
+/**
+ * @brief Put a stowed client onto the current workspace, floating in the
+ * middle of it, and focus it.
+ *
+ * @param c The client to be shown.
+ * @param w The width of the client.
+ * @param h The height of the client.
+ */
+static void unstow_client(Client *c, uint16_t w, uint16_t h)
+{
+	attach_client(cw, wss[cw].tail, c);
+	mru_add(cw, c);
+	c->ws = cw;
+	if (c->is_urgent)
+		urgent_push(c);
+	win_index_put(&clients_by_win, c);
 	wss[cw].client_cnt++;
+	wss[cw].current = c;
+	client_list_dirty = stacking_dirty = true;
 
-	wss[cw].current->is_floating = true;
-	wss[cw].current->w = SCRATCHPAD_WIDTH;
-	wss[cw].current->h = SCRATCHPAD_HEIGHT;
-	wss[cw].current->x = (screen_width / 2) - (wss[cw].current->w / 2);
-	wss[cw].current->y = (screen_height - wss[cw].bar_height - wss[cw].current->h) / 2;
+	centre_float(c, w, h);
+	c->is_parked = false;
+	ewmh_set_wm_state(c);
+	update_focused_client(c);
+}
 
-	xcb_map_window(dpy, wss[cw].current->win);
-	update_focused_client(wss[cw].current);
+/**
+ * @brief Make a client float in the middle of its workspace.
+ *
+ * @param c The client.
+ * @param w The width that the client should have.
+ * @param h The height that the client should have.
+ */
+static void centre_float(Client *c, uint16_t w, uint16_t h)
+{
+	unsigned int group = stacking_group(c);
+	xcb_rectangle_t r = ws_area(c->ws);
+
+	c->is_floating = true;
+	regroup_client(c, group);
+	c->w = w;
+	c->h = h;
+	c->x = r.x + (r.width - w) / 2;
+	c->y = r.y + (r.height - h) / 2;
+}
+
+/**
+ * @brief Check whether a newly mapped window belongs to a named scratchpad
+ * that has just been started.
+ *
+ * @param props The properties of the window that is being mapped.
+ *
+ * @return The index of the scratchpad, or -1 if the window isn't one.
+ */
+static int claim_scratchpad(char * const *props)
+{
+	unsigned int i;
+
+	for (i = 0; i < LENGTH(scratch); i++) {
+		if (scratch[i].spawning && ((props[PROP_INSTANCE]
+				&& strstr(props[PROP_INSTANCE], scratchpads[i].name))
+				|| (props[PROP_CLASS]
+				&& strstr(props[PROP_CLASS], scratchpads[i].name)))) {
+			scratch[i].spawning = false;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Find the scratchpad slot that holds a stowed client.
+ *
+ * @param win The window of the client.
+ *
+ * @return The slot, or NULL if win isn't a stowed client's window.
+ */
+static Client **stowed_slot(xcb_window_t win)
+{
+	unsigned int i;
+
+	if (scratchpad && scratchpad->win == win)
+		return &scratchpad;
+	for (i = 0; i < LENGTH(scratch); i++)
+		if (scratch[i].c && !scratch[i].c->ws && scratch[i].c->win == win)
+			return &scratch[i].c;
+	return NULL;
+}
+
+/**
+ * @brief Forget a stowed client whose window has gone away.
+ *
+ * A named scratchpad is started again the next time it is asked for.
+ *
+ * @param slot The slot that holds the client.
+ */
+static void drop_stowed(Client **slot)
+{
+	log_info("Stowed client <%p> has gone away", *slot);
+	client_release(&clients, *slot);
+	*slot = NULL;
+}
+
+/**
+ * @brief Stop treating a client as a named scratchpad, such as when it is
+ * removed or cut. The scratchpad is started again the next time it is asked
+ * for.
+ *
+ * @param c The client.
+ */
+static void forget_scratchpad(Client *c)
+{
+	if (!c->scratch_id)
+		return;
+	scratch[c->scratch_id - 1].c = NULL;
+	c->scratch_id = 0;
 }